@@ -6,9 +6,18 @@
 
 #pragma once
 
+#include <atomic>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <iterator>
+#include <new>
+#include <string>
+#include <type_traits>
 #include <utility>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 namespace emilib {
 
@@ -22,8 +31,85 @@ namespace emilib {
         }
     };
     
-    /// A cache-friendly hash table with open addressing, linear probing and power-of-two capacity
-    template <typename KeyT, typename ValueT, typename HashT = std::hash<KeyT>, typename CompT = HashMapEqualTo<KeyT>>
+    /// A cheap mixer for integer keys: multiplying by a large odd constant spreads each input bit
+    /// over the high half of the product, and folding that half back down mixes the low bits too.
+    struct HashMapMulXorShift64
+    {
+        size_t operator()(uint64_t x) const
+        {
+            x *= 0x9e3779b97f4a7c15ULL;
+            return (size_t)(x ^ (x >> 32));
+        }
+    };
+    
+    /// The hash a map uses unless given one. std::hash is the identity on integers in common standard
+    /// libraries, so integer keys that differ mostly in their high bits, such as packed k-mers over a
+    /// skewed alphabet, would crowd into a few buckets once masked. Integers are mixed first.
+    template <typename KeyT, bool = std::is_integral<KeyT>::value>
+    struct HashMapHash : std::hash<KeyT> { };
+    
+    template <typename KeyT>
+    struct HashMapHash<KeyT, true> : HashMapMulXorShift64 { };
+    
+    /// Characters owned by someone else, such as one window of a longer sequence, that can look up a
+    /// std::string key without first being copied into one.
+    struct HashMapStringRef
+    {
+        const char* data;
+        size_t      size;
+        
+        explicit operator std::string() const { return std::string(data, size); }
+    };
+    
+    /// Hashes a string eight bytes at a time, with the same multiply-xorshift step as integer keys.
+    /// A std::string and a HashMapStringRef over the same characters hash alike.
+    struct HashMapStringHash
+    {
+        size_t operator()(const HashMapStringRef& s) const
+        {
+            uint64_t h = s.size * 0x9e3779b97f4a7c15ULL;
+            uint64_t word;
+            size_t i = 0;
+            for (; i + 8 <= s.size; i += 8) {
+                std::memcpy(&word, s.data + i, 8);
+                h = (h ^ word) * 0x9e3779b97f4a7c15ULL;
+                h ^= h >> 32;
+            }
+            word = 0;
+            if (i < s.size) {
+                std::memcpy(&word, s.data + i, s.size - i);
+            }
+            h = (h ^ word) * 0x9e3779b97f4a7c15ULL;
+            return (size_t)(h ^ (h >> 32));
+        }
+        
+        size_t operator()(const std::string& s) const
+        {
+            return (*this)(HashMapStringRef{ s.data(), s.size() });
+        }
+    };
+    
+    template <>
+    struct HashMapHash<std::string, false> : HashMapStringHash { };
+    
+    template <>
+    struct HashMapEqualTo<std::string>
+    {
+        bool operator()(const std::string& lhs, const std::string& rhs) const
+        {
+            return lhs == rhs;
+        }
+        
+        bool operator()(const std::string& lhs, const HashMapStringRef& rhs) const
+        {
+            return lhs.size() == rhs.size && std::memcmp(lhs.data(), rhs.data, rhs.size) == 0;
+        }
+    };
+    
+    /// A cache-friendly hash table with open addressing, linear probing and power-of-two capacity.
+    /// Erasing shifts the rest of the probe chain back instead of leaving a tombstone, so a table
+    /// that is filled and emptied again and again keeps the probe lengths of a fresh one.
+    template <typename KeyT, typename ValueT, typename HashT = HashMapHash<KeyT>, typename CompT = HashMapEqualTo<KeyT>>
     class HashMap
     {
     private:
@@ -181,7 +267,7 @@ namespace emilib {
         HashMap(const HashMap& other)
         {
             reserve(other.size());
-            insert(cbegin(other), cend(other));
+            insert(other.begin(), other.end());
         }
         
         HashMap(HashMap&& other)
@@ -193,7 +279,7 @@ namespace emilib {
         {
             clear();
             reserve(other.size());
-            insert(cbegin(other), cend(other));
+            insert(other.begin(), other.end());
             return *this;
         }
         
@@ -261,6 +347,17 @@ namespace emilib {
             return _num_filled==0;
         }
         
+        size_t bucket_count() const
+        {
+            return _num_buckets;
+        }
+        
+        /// The longest probe any lookup makes (a miss probes this far), or -1 when empty.
+        int max_probe_length() const
+        {
+            return _max_probe_length;
+        }
+        
         // ------------------------------------------------------------
         
         iterator find(const KeyT& key)
@@ -411,6 +508,54 @@ namespace emilib {
             return _pairs[bucket].second;
         }
         
+        /// The hash of a key, or of anything HashT and CompT accept in its place (say, a
+        /// HashMapStringRef for a std::string key), to pass on to the _with_hash functions.
+        template <typename LookupT>
+        size_t hash_of(const LookupT& key) const
+        {
+            return _hasher(key);
+        }
+        
+        /// Like find(), with the key's hash_of() given, so that one hash serves several calls.
+        template <typename LookupT>
+        iterator find_with_hash(const LookupT& key, size_t hash_value)
+        {
+            auto bucket = this->find_filled_bucket(key, hash_value);
+            if (bucket == (size_t)-1) {
+                return this->end();
+            }
+            return iterator(this, bucket);
+        }
+        
+        template <typename LookupT>
+        const_iterator find_with_hash(const LookupT& key, size_t hash_value) const
+        {
+            auto bucket = this->find_filled_bucket(key, hash_value);
+            if (bucket == (size_t)-1) {
+                return this->end();
+            }
+            return const_iterator(this, bucket);
+        }
+        
+        /// Like insert() of (KeyT(key), ValueT()), with the key's hash_of() given.
+        /// The key is only converted to a KeyT when it is not in the map yet.
+        template <typename LookupT>
+        std::pair<iterator, bool> insert_with_hash(const LookupT& key, size_t hash_value)
+        {
+            check_expand_need();
+            
+            auto bucket = find_or_allocate(key, hash_value);
+            
+            if (_states[bucket] == State::FILLED) {
+                return { iterator(this, bucket), false };
+            } else {
+                _states[bucket] = State::FILLED;
+                new(_pairs + bucket) PairT(KeyT(key), ValueT());
+                _num_filled++;
+                return { iterator(this, bucket), true };
+            }
+        }
+        
         // -------------------------------------------------------
         
         /// Erase an element from the hash table.
@@ -419,9 +564,7 @@ namespace emilib {
         {
             auto bucket = find_filled_bucket(key);
             if (bucket != (size_t)-1) {
-                _states[bucket] = State::ACTIVE;
-                _pairs[bucket].~PairT();
-                _num_filled -= 1;
+                erase_bucket(bucket);
                 return true;
             } else {
                 return false;
@@ -430,13 +573,15 @@ namespace emilib {
         
         /// Erase an element using an iterator.
         /// Returns an iterator to the next element (or end()).
+        /// An element shifted back from the start of the table to its end may be visited twice.
         iterator erase(iterator it)
         {
             //DCHECK_EQ_F(it._map, this);
             //DCHECK_LT_F(it._bucket, _num_buckets);
-            _states[it._bucket] = State::ACTIVE;
-            _pairs[it._bucket].~PairT();
-            _num_filled -= 1;
+            erase_bucket(it._bucket);
+            if (_states[it._bucket] == State::FILLED) {
+                return it; // The next element of the chain moved in here
+            }
             return ++it;
         }
         
@@ -515,12 +660,42 @@ namespace emilib {
             reserve(_num_filled + 1);
         }
         
+        // Empty a bucket, then walk the rest of its chain and move back each element
+        // that may sit in the hole without landing before its home bucket.
+        void erase_bucket(size_t bucket)
+        {
+            _pairs[bucket].~PairT();
+            _num_filled -= 1;
+            
+            size_t hole = bucket;
+            for (size_t next = (hole + 1) & _mask; _states[next] == State::FILLED; next = (next + 1) & _mask) {
+                size_t home = _hasher(_pairs[next].first) & _mask;
+                if (((next - home) & _mask) >= ((next - hole) & _mask)) {
+                    new(_pairs + hole) PairT(std::move(_pairs[next]));
+                    _pairs[next].~PairT();
+                    hole = next;
+                }
+            }
+            _states[hole] = State::INACTIVE;
+            
+            if (_num_filled == 0) {
+                _max_probe_length = -1;
+            }
+        }
+        
         // Find the bucket with this key, or return nullptr
         size_t find_filled_bucket(const KeyT& key) const
         {
             if (empty()) { return (size_t)-1; } // Optimization
             
-            auto hash_value = _hasher(key);
+            return find_filled_bucket(key, _hasher(key));
+        }
+        
+        template <typename LookupT>
+        size_t find_filled_bucket(const LookupT& key, size_t hash_value) const
+        {
+            if (empty()) { return (size_t)-1; } // Optimization
+            
             for (int offset=0; offset<=_max_probe_length; ++offset) {
                 auto bucket = (hash_value + offset) & _mask;
                 if (_states[bucket] == State::FILLED && _comp(_pairs[bucket].first, key)) {
@@ -537,35 +712,25 @@ namespace emilib {
         // In the latter case, the bucket is expected to be filled.
         size_t find_or_allocate(const KeyT& key)
         {
-            auto hash_value = _hasher(key);
-            size_t hole = (size_t)-1;
+            return find_or_allocate(key, _hasher(key));
+        }
+        
+        template <typename LookupT>
+        size_t find_or_allocate(const LookupT& key, size_t hash_value)
+        {
             int offset=0;
             for (; offset<=_max_probe_length; ++offset) {
                 auto bucket = (hash_value + offset) & _mask;
                 
-                if (_states[bucket] == State::FILLED) {
-                    if (_comp(_pairs[bucket].first, key)) {
-                        return bucket;
-                    }
-                } else if (_states[bucket] == State::INACTIVE) {
+                if (_states[bucket] != State::FILLED) {
+                    return bucket; // End of the chain!
+                }
+                if (_comp(_pairs[bucket].first, key)) {
                     return bucket;
-                } else {
-                    // ACTIVE: keep searching
-                    if (hole == (size_t)-1) {
-                        hole = bucket;
-                    }
                 }
             }
             
-            // No key found - but maybe a hole for it
-            
-            //DCHECK_EQ_F(offset, _max_probe_length+1);
-            
-            if (hole != (size_t)-1) {
-                return hole;
-            }
-            
-            // No hole found within _max_probe_length
+            // No key found, and the chain runs past _max_probe_length
             for (; ; ++offset) {
                 auto bucket = (hash_value + offset) & _mask;
                 
@@ -594,8 +759,7 @@ namespace emilib {
     private:
         enum class State : uint8_t
             {
-                INACTIVE, // Never been touched
-                ACTIVE,   // Is inside a search-chain, but is empty
+                INACTIVE, // Empty: ends any search-chain that reaches it
                 FILLED    // Is set with key/value
             };
         
@@ -609,4 +773,950 @@ namespace emilib {
         size_t  _mask             = 0;  // _num_buckets minus one
     };
     
+    // ------------------------------------------------------------------------
+
+    /// A variant of HashMap with the same interface, laid out like a Swiss table. One control byte
+    /// per slot holds either 7 bits of the key's hash (a tag) or marks the slot as empty or deleted.
+    /// Slots are probed in aligned groups of 16: a single SSE2 compare finds every slot in a group
+    /// whose tag matches, so full keys are compared only on a likely hit, and a lookup ends at the
+    /// first group with an empty slot. Power-of-two capacity, at most 7/8 full.
+    template <typename KeyT, typename ValueT, typename HashT = HashMapHash<KeyT>, typename CompT = HashMapEqualTo<KeyT>>
+    class GroupHashMap
+    {
+    private:
+        using MyType = GroupHashMap<KeyT, ValueT, HashT, CompT>;
+        
+        using PairT = std::pair<KeyT, ValueT>;
+    public:
+        using size_type       = size_t;
+        using value_type      = PairT;
+        using reference       = PairT&;
+        using const_reference = const PairT&;
+        
+        class iterator
+        {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using difference_type   = size_t;
+            using distance_type     = size_t;
+            using value_type        = std::pair<KeyT, ValueT>;
+            using pointer           = value_type*;
+            using reference         = value_type&;
+            
+            iterator() { }
+            
+            iterator(MyType* hash_map, size_t bucket) : _map(hash_map), _bucket(bucket)
+            {
+            }
+            
+            iterator& operator++()
+            {
+                this->goto_next_element();
+                return *this;
+            }
+            
+            iterator operator++(int)
+            {
+                size_t old_index = _bucket;
+                this->goto_next_element();
+                return iterator(_map, old_index);
+            }
+            
+            reference operator*() const
+            {
+                return _map->_pairs[_bucket];
+            }
+            
+            pointer operator->() const
+            {
+                return _map->_pairs + _bucket;
+            }
+            
+            bool operator==(const iterator& rhs)
+            {
+                return this->_bucket == rhs._bucket;
+            }
+            
+            bool operator!=(const iterator& rhs)
+            {
+                return this->_bucket != rhs._bucket;
+            }
+            
+        private:
+            void goto_next_element()
+            {
+                do {
+                    _bucket++;
+                } while (_bucket < _map->_num_buckets && _map->_ctrl[_bucket] < 0);
+            }
+            
+        public:
+            MyType* _map;
+            size_t  _bucket;
+        };
+        
+        class const_iterator
+        {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using difference_type   = size_t;
+            using distance_type     = size_t;
+            using value_type        = const std::pair<KeyT, ValueT>;
+            using pointer           = value_type*;
+            using reference         = value_type&;
+            
+            const_iterator() { }
+            
+            const_iterator(iterator proto) : _map(proto._map), _bucket(proto._bucket)
+            {
+            }
+            
+            const_iterator(const MyType* hash_map, size_t bucket) : _map(hash_map), _bucket(bucket)
+            {
+            }
+            
+            const_iterator& operator++()
+            {
+                this->goto_next_element();
+                return *this;
+            }
+            
+            const_iterator operator++(int)
+            {
+                size_t old_index = _bucket;
+                this->goto_next_element();
+                return const_iterator(_map, old_index);
+            }
+            
+            reference operator*() const
+            {
+                return _map->_pairs[_bucket];
+            }
+            
+            pointer operator->() const
+            {
+                return _map->_pairs + _bucket;
+            }
+            
+            bool operator==(const const_iterator& rhs)
+            {
+                return this->_bucket == rhs._bucket;
+            }
+            
+            bool operator!=(const const_iterator& rhs)
+            {
+                return this->_bucket != rhs._bucket;
+            }
+            
+        private:
+            void goto_next_element()
+            {
+                do {
+                    _bucket++;
+                } while (_bucket < _map->_num_buckets && _map->_ctrl[_bucket] < 0);
+            }
+            
+        public:
+            const MyType* _map;
+            size_t        _bucket;
+        };
+        
+        // ------------------------------------------------------------------------
+        
+        GroupHashMap() = default;
+        
+        GroupHashMap(const GroupHashMap& other)
+        {
+            reserve(other.size());
+            insert(other.cbegin(), other.cend());
+        }
+        
+        GroupHashMap(GroupHashMap&& other)
+        {
+            *this = std::move(other);
+        }
+        
+        GroupHashMap& operator=(const GroupHashMap& other)
+        {
+            clear();
+            reserve(other.size());
+            insert(other.cbegin(), other.cend());
+            return *this;
+        }
+        
+        void operator=(GroupHashMap&& other)
+        {
+            this->swap(other);
+        }
+        
+        ~GroupHashMap()
+        {
+            for (size_t bucket=0; bucket<_num_buckets; ++bucket) {
+                if (_ctrl[bucket] >= 0) {
+                    _pairs[bucket].~PairT();
+                }
+            }
+            free(_ctrl);
+            free(_pairs);
+        }
+        
+        void swap(GroupHashMap& other)
+        {
+            std::swap(_hasher,      other._hasher);
+            std::swap(_comp,        other._comp);
+            std::swap(_ctrl,        other._ctrl);
+            std::swap(_pairs,       other._pairs);
+            std::swap(_num_buckets, other._num_buckets);
+            std::swap(_num_filled,  other._num_filled);
+            std::swap(_num_deleted, other._num_deleted);
+            std::swap(_mask,        other._mask);
+        }
+        
+        // -------------------------------------------------------------
+        
+        iterator begin()
+        {
+            size_t bucket = 0;
+            while (bucket<_num_buckets && _ctrl[bucket] < 0) {
+                ++bucket;
+            }
+            return iterator(this, bucket);
+        }
+        
+        const_iterator begin() const
+        {
+            size_t bucket = 0;
+            while (bucket<_num_buckets && _ctrl[bucket] < 0) {
+                ++bucket;
+            }
+            return const_iterator(this, bucket);
+        }
+        
+        const_iterator cbegin() const
+        { return begin(); }
+        
+        iterator end()
+        { return iterator(this, _num_buckets); }
+        
+        const_iterator end() const
+        { return const_iterator(this, _num_buckets); }
+        
+        const_iterator cend() const
+        { return end(); }
+        
+        size_t size() const
+        {
+            return _num_filled;
+        }
+        
+        bool empty() const
+        {
+            return _num_filled==0;
+        }
+        
+        size_t bucket_count() const
+        {
+            return _num_buckets;
+        }
+        
+        /// Slots marked deleted, which probes step over as if they were filled.
+        size_t deleted_count() const
+        {
+            return _num_deleted;
+        }
+        
+        /// How many groups a lookup of key reads before it finds key or a group with an
+        /// empty slot (1 when it stops in its home group).
+        size_t probe_length(const KeyT& key) const
+        {
+            if (_num_buckets == 0) { return 0; }
+            
+            size_t hash_value = _hasher(key);
+            size_t group = (hash_value >> 7) & _mask;
+            for (size_t step=1; step<=_mask+1; ++step) {
+                const int8_t* ctrl = _ctrl + group * GROUP_SIZE;
+                for (uint32_t match = match_byte(ctrl, tag(hash_value)); match; match &= match - 1) {
+                    if (_comp(_pairs[group * GROUP_SIZE + __builtin_ctz(match)].first, key)) {
+                        return step;
+                    }
+                }
+                if (match_byte(ctrl, EMPTY)) {
+                    return step;
+                }
+                group = (group + step) & _mask;
+            }
+            return _mask + 1;
+        }
+        
+        // ------------------------------------------------------------
+        
+        iterator find(const KeyT& key)
+        {
+            auto bucket = this->find_filled_bucket(key);
+            if (bucket == (size_t)-1) {
+                return this->end();
+            }
+            return iterator(this, bucket);
+        }
+        
+        const_iterator find(const KeyT& key) const
+        {
+            auto bucket = this->find_filled_bucket(key);
+            if (bucket == (size_t)-1) {
+                return this->end();
+            }
+            return const_iterator(this, bucket);
+        }
+        
+        bool contains(const KeyT& k) const
+        {
+            return find_filled_bucket(k) != (size_t)-1;
+        }
+        
+        size_t count(const KeyT& k) const
+        {
+            return find_filled_bucket(k) != (size_t)-1 ? 1 : 0;
+        }
+        
+        /// Returns the matching ValueT or nullptr if k isn't found.
+        ValueT* try_get(const KeyT& k)
+        {
+            auto bucket = find_filled_bucket(k);
+            if (bucket != (size_t)-1) {
+                return &_pairs[bucket].second;
+            } else {
+                return nullptr;
+            }
+        }
+        
+        /// Const version of the above
+        const ValueT* try_get(const KeyT& k) const
+        {
+            auto bucket = find_filled_bucket(k);
+            if (bucket != (size_t)-1) {
+                return &_pairs[bucket].second;
+            } else {
+                return nullptr;
+            }
+        }
+        
+        /// Convenience function.
+        const ValueT get_or_return_default(const KeyT& k) const
+        {
+            const ValueT* ret = try_get(k);
+            if (ret) {
+                return *ret;
+            } else {
+                return ValueT();
+            }
+        }
+        
+        // -----------------------------------------------------
+        
+        /// Returns a pair consisting of an iterator to the inserted element
+        /// (or to the element that prevented the insertion)
+        /// and a bool denoting whether the insertion took place.
+        std::pair<iterator, bool> insert(const KeyT& key, const ValueT& value)
+        {
+            check_expand_need();
+            
+            auto hash_value = _hasher(key);
+            auto bucket = find_or_allocate(key, hash_value);
+            
+            if (_ctrl[bucket] >= 0) {
+                return { iterator(this, bucket), false };
+            } else {
+                set_filled(bucket, hash_value);
+                new(_pairs + bucket) PairT(key, value);
+                return { iterator(this, bucket), true };
+            }
+        }
+        
+        std::pair<iterator, bool> insert(const std::pair<KeyT, ValueT>& p)
+        {
+            return insert(p.first, p.second);
+        }
+        
+        void insert(const_iterator begin, const_iterator end)
+        {
+            for (; begin != end; ++begin) {
+                insert(begin->first, begin->second);
+            }
+        }
+        
+        /// Same as above, but contains(key) MUST be false
+        void insert_unique(KeyT&& key, ValueT&& value)
+        {
+            check_expand_need();
+            auto hash_value = _hasher(key);
+            auto bucket = find_empty_bucket(hash_value);
+            set_filled(bucket, hash_value);
+            new(_pairs + bucket) PairT(std::move(key), std::move(value));
+        }
+        
+        void insert_unique(std::pair<KeyT, ValueT>&& p)
+        {
+            insert_unique(std::move(p.first), std::move(p.second));
+        }
+        
+        /// Return the old value or ValueT() if it didn't exist.
+        ValueT set_get(const KeyT& key, const ValueT& new_value)
+        {
+            check_expand_need();
+            
+            auto hash_value = _hasher(key);
+            auto bucket = find_or_allocate(key, hash_value);
+            
+            // Check if inserting a new value rather than overwriting an old entry
+            if (_ctrl[bucket] >= 0) {
+                ValueT old_value = _pairs[bucket].second;
+                _pairs[bucket].second = new_value;
+                return old_value;
+            } else {
+                set_filled(bucket, hash_value);
+                new(_pairs + bucket) PairT(key, new_value);
+                return ValueT();
+            }
+        }
+        
+        /// Like std::map<KeyT,ValueT>::operator[].
+        ValueT& operator[](const KeyT& key)
+        {
+            check_expand_need();
+            
+            auto hash_value = _hasher(key);
+            auto bucket = find_or_allocate(key, hash_value);
+            
+            /* Check if inserting a new value rather than overwriting an old entry */
+            if (_ctrl[bucket] < 0) {
+                set_filled(bucket, hash_value);
+                new(_pairs + bucket) PairT(key, ValueT());
+            }
+            
+            return _pairs[bucket].second;
+        }
+        
+        /// Add amounts[i] to the value of keys[i] for each i < n, as operator[] would, and call
+        /// on_insert(i) for each key that was not yet in the map. Keys are hashed and their groups
+        /// prefetched a batch at a time before any is probed, so that the cache misses of a batch
+        /// overlap instead of following one another.
+        template <typename FnT>
+        void increment_batch(const KeyT* keys, const ValueT* amounts, size_t n, FnT on_insert)
+        {
+            size_t hashes[BATCH_SIZE];
+            for (size_t start=0; start<n; start+=BATCH_SIZE) {
+                const size_t end = (n - start < BATCH_SIZE) ? n : start + BATCH_SIZE;
+                for (size_t i=start; i<end; ++i) {
+                    hashes[i - start] = _hasher(keys[i]);
+                    if (_num_buckets) {
+                        size_t group = (hashes[i - start] >> 7) & _mask;
+                        __builtin_prefetch(_ctrl + group * GROUP_SIZE);
+                        __builtin_prefetch(_pairs + group * GROUP_SIZE);
+                    }
+                }
+                for (size_t i=start; i<end; ++i) {
+                    check_expand_need();
+                    auto bucket = find_or_allocate(keys[i], hashes[i - start]);
+                    if (_ctrl[bucket] < 0) {
+                        set_filled(bucket, hashes[i - start]);
+                        new(_pairs + bucket) PairT(keys[i], ValueT());
+                        on_insert(i);
+                    }
+                    _pairs[bucket].second += amounts[i];
+                }
+            }
+        }
+        
+        /// The hash of a key, or of anything HashT and CompT accept in its place (say, a
+        /// HashMapStringRef for a std::string key), to pass on to the _with_hash functions.
+        template <typename LookupT>
+        size_t hash_of(const LookupT& key) const
+        {
+            return _hasher(key);
+        }
+        
+        /// Like find(), with the key's hash_of() given, so that one hash serves several calls.
+        template <typename LookupT>
+        iterator find_with_hash(const LookupT& key, size_t hash_value)
+        {
+            auto bucket = this->find_filled_bucket(key, hash_value);
+            if (bucket == (size_t)-1) {
+                return this->end();
+            }
+            return iterator(this, bucket);
+        }
+        
+        template <typename LookupT>
+        const_iterator find_with_hash(const LookupT& key, size_t hash_value) const
+        {
+            auto bucket = this->find_filled_bucket(key, hash_value);
+            if (bucket == (size_t)-1) {
+                return this->end();
+            }
+            return const_iterator(this, bucket);
+        }
+        
+        /// Like insert() of (KeyT(key), ValueT()), with the key's hash_of() given.
+        /// The key is only converted to a KeyT when it is not in the map yet.
+        template <typename LookupT>
+        std::pair<iterator, bool> insert_with_hash(const LookupT& key, size_t hash_value)
+        {
+            check_expand_need();
+            
+            auto bucket = find_or_allocate(key, hash_value);
+            
+            if (_ctrl[bucket] >= 0) {
+                return { iterator(this, bucket), false };
+            } else {
+                set_filled(bucket, hash_value);
+                new(_pairs + bucket) PairT(KeyT(key), ValueT());
+                return { iterator(this, bucket), true };
+            }
+        }
+        
+        // -------------------------------------------------------
+        
+        /// Erase an element from the hash table.
+        /// return false if element was not found
+        bool erase(const KeyT& key)
+        {
+            auto bucket = find_filled_bucket(key);
+            if (bucket != (size_t)-1) {
+                erase_bucket(bucket);
+                return true;
+            } else {
+                return false;
+            }
+        }
+        
+        /// Erase an element using an iterator.
+        /// Returns an iterator to the next element (or end()).
+        iterator erase(iterator it)
+        {
+            erase_bucket(it._bucket);
+            return ++it;
+        }
+        
+        /// Remove all elements, keeping full capacity.
+        void clear()
+        {
+            for (size_t bucket=0; bucket<_num_buckets; ++bucket) {
+                if (_ctrl[bucket] >= 0) {
+                    _pairs[bucket].~PairT();
+                }
+            }
+            std::fill_n(_ctrl, _num_buckets, (int8_t)EMPTY);
+            _num_filled  = 0;
+            _num_deleted = 0;
+        }
+        
+        /// Make room for this many elements
+        void reserve(size_t num_elems)
+        {
+            size_t required_buckets = num_elems + num_elems/7 + 1;
+            if (required_buckets <= _num_buckets) {
+                return;
+            }
+            size_t num_buckets = GROUP_SIZE;
+            while (num_buckets < required_buckets) { num_buckets *= 2; }
+            rehash(num_buckets);
+        }
+        
+    private:
+        enum : int8_t
+            {
+                EMPTY   = -128, // Never been touched, or nothing has probed past it
+                DELETED = -2    // Erased, but probes may continue past it
+                                // Filled slots hold a 7-bit tag, 0..127
+            };
+        
+        static const size_t GROUP_SIZE = 16;
+        static const size_t BATCH_SIZE = 16; // Keys hashed and prefetched ahead of probing
+        
+        // Bit i is set where control byte i of the group equals b
+        static uint32_t match_byte(const int8_t* group, int8_t b)
+        {
+#if defined(__SSE2__)
+            __m128i ctrl = _mm_loadu_si128((const __m128i*)group);
+            return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(b)));
+#else
+            uint32_t mask = 0;
+            for (size_t i=0; i<GROUP_SIZE; ++i) {
+                mask |= (uint32_t)(group[i] == b) << i;
+            }
+            return mask;
+#endif
+        }
+        
+        // Bit i is set where slot i of the group is empty or deleted (the sign bit of its control byte)
+        static uint32_t match_free(const int8_t* group)
+        {
+#if defined(__SSE2__)
+            return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+#else
+            uint32_t mask = 0;
+            for (size_t i=0; i<GROUP_SIZE; ++i) {
+                mask |= (uint32_t)(group[i] < 0) << i;
+            }
+            return mask;
+#endif
+        }
+        
+        static int8_t tag(size_t hash_value)
+        {
+            return (int8_t)(hash_value & 0x7F);
+        }
+        
+        void set_filled(size_t bucket, size_t hash_value)
+        {
+            if (_ctrl[bucket] == DELETED) {
+                _num_deleted--;
+            }
+            _ctrl[bucket] = tag(hash_value);
+            _num_filled++;
+        }
+        
+        void erase_bucket(size_t bucket)
+        {
+            // A group that still has an empty slot has never stopped a probe from ending in it
+            const int8_t* group = _ctrl + (bucket & ~(GROUP_SIZE - 1));
+            if (match_byte(group, EMPTY)) {
+                _ctrl[bucket] = EMPTY;
+            } else {
+                _ctrl[bucket] = DELETED;
+                _num_deleted++;
+            }
+            _pairs[bucket].~PairT();
+            _num_filled -= 1;
+            
+            // An empty map has no chains left to keep, so its tombstones can all go; the sweep
+            // waits for enough of them to pay for touching every control byte
+            if (_num_filled == 0 && _num_deleted * 32 >= _num_buckets) {
+                std::fill_n(_ctrl, _num_buckets, (int8_t)EMPTY);
+                _num_deleted = 0;
+            }
+        }
+        
+        // Can we fit another element?
+        void check_expand_need()
+        {
+            if ((_num_filled + _num_deleted + 1) * 8 <= _num_buckets * 7) {
+                // Room to spare, but once tombstones take an eighth of it they lengthen
+                // too many probes: clear them out at the same size
+                if (_num_deleted * 8 >= _num_buckets) {
+                    rehash(_num_buckets);
+                }
+                return;
+            }
+            // Mostly tombstones: clear them out at the same size
+            if ((_num_filled + 1) * 16 <= _num_buckets * 7) {
+                rehash(_num_buckets);
+            } else {
+                rehash(_num_buckets ? 2 * _num_buckets : GROUP_SIZE);
+            }
+        }
+        
+        void rehash(size_t num_buckets)
+        {
+            auto new_ctrl  = (int8_t*)malloc(num_buckets * sizeof(int8_t));
+            auto new_pairs = (PairT*)malloc(num_buckets * sizeof(PairT));
+            
+            if (!new_ctrl || !new_pairs) {
+                free(new_ctrl);
+                free(new_pairs);
+                throw std::bad_alloc();
+            }
+            
+            auto old_num_buckets = _num_buckets;
+            auto old_ctrl        = _ctrl;
+            auto old_pairs       = _pairs;
+            
+            _num_filled  = 0;
+            _num_deleted = 0;
+            _num_buckets = num_buckets;
+            _mask        = num_buckets / GROUP_SIZE - 1;
+            _ctrl        = new_ctrl;
+            _pairs       = new_pairs;
+            
+            std::fill_n(_ctrl, num_buckets, (int8_t)EMPTY);
+            
+            for (size_t src_bucket=0; src_bucket<old_num_buckets; src_bucket++) {
+                if (old_ctrl[src_bucket] >= 0) {
+                    auto& src_pair = old_pairs[src_bucket];
+                    auto hash_value = _hasher(src_pair.first);
+                    auto dst_bucket = find_empty_bucket(hash_value);
+                    set_filled(dst_bucket, hash_value);
+                    new(_pairs + dst_bucket) PairT(std::move(src_pair));
+                    src_pair.~PairT();
+                }
+            }
+            
+            free(old_ctrl);
+            free(old_pairs);
+        }
+        
+        // Find the bucket with this key, or return (size_t)-1
+        size_t find_filled_bucket(const KeyT& key) const
+        {
+            if (empty()) { return (size_t)-1; } // Optimization
+            
+            return find_filled_bucket(key, _hasher(key));
+        }
+        
+        template <typename LookupT>
+        size_t find_filled_bucket(const LookupT& key, size_t hash_value) const
+        {
+            if (empty()) { return (size_t)-1; } // Optimization
+            
+            size_t group = (hash_value >> 7) & _mask;
+            // Triangular steps over a power-of-two number of groups visit each group once
+            for (size_t step=1; step<=_mask+1; ++step) {
+                const int8_t* ctrl = _ctrl + group * GROUP_SIZE;
+                for (uint32_t match = match_byte(ctrl, tag(hash_value)); match; match &= match - 1) {
+                    auto bucket = group * GROUP_SIZE + __builtin_ctz(match);
+                    if (_comp(_pairs[bucket].first, key)) {
+                        return bucket;
+                    }
+                }
+                if (match_byte(ctrl, EMPTY)) {
+                    return (size_t)-1; // End of the chain!
+                }
+                group = (group + step) & _mask;
+            }
+            return (size_t)-1;
+        }
+        
+        // Find the bucket with this key, or return a good empty or deleted bucket to place the key in.
+        // In the latter case, the bucket is expected to be filled.
+        template <typename LookupT>
+        size_t find_or_allocate(const LookupT& key, size_t hash_value)
+        {
+            size_t hole = (size_t)-1;
+            size_t group = (hash_value >> 7) & _mask;
+            for (size_t step=1; step<=_mask+1; ++step) {
+                const int8_t* ctrl = _ctrl + group * GROUP_SIZE;
+                for (uint32_t match = match_byte(ctrl, tag(hash_value)); match; match &= match - 1) {
+                    auto bucket = group * GROUP_SIZE + __builtin_ctz(match);
+                    if (_comp(_pairs[bucket].first, key)) {
+                        return bucket;
+                    }
+                }
+                if (hole == (size_t)-1) {
+                    uint32_t free_slots = match_free(ctrl);
+                    if (free_slots) {
+                        hole = group * GROUP_SIZE + __builtin_ctz(free_slots);
+                    }
+                }
+                if (match_byte(ctrl, EMPTY)) {
+                    break;
+                }
+                group = (group + step) & _mask;
+            }
+            return hole;
+        }
+        
+        // key is not in this map. Find a place to put it.
+        size_t find_empty_bucket(size_t hash_value)
+        {
+            size_t group = (hash_value >> 7) & _mask;
+            for (size_t step=1; ; ++step) {
+                uint32_t free_slots = match_free(_ctrl + group * GROUP_SIZE);
+                if (free_slots) {
+                    return group * GROUP_SIZE + __builtin_ctz(free_slots);
+                }
+                group = (group + step) & _mask;
+            }
+        }
+        
+    private:
+        HashT   _hasher;
+        CompT   _comp;
+        int8_t* _ctrl        = nullptr;
+        PairT*  _pairs       = nullptr;
+        size_t  _num_buckets = 0;
+        size_t  _num_filled  = 0;
+        size_t  _num_deleted = 0;
+        size_t  _mask        = 0;  // number of groups minus one
+    };
+    
+    // ------------------------------------------------------------------------
+
+    /// A fixed-capacity counting table for integer keys that many threads can update at once.
+    /// Open addressing with linear probing over a power-of-two array of (key, count) slots: a new key
+    /// claims an empty slot with a compare-and-swap, and counts are added with fetch_add. Nothing is
+    /// ever moved or erased, so there are no locks and no rehashing. The capacity is set up front
+    /// with reserve(), and add() fails once the table is full. EmptyKey marks free slots, so its own
+    /// count is kept apart from them.
+    template <typename KeyT, typename CountT, typename HashT = HashMapHash<KeyT>, KeyT EmptyKey = (KeyT)-1>
+    class ConcurrentCountMap
+    {
+    private:
+        struct Slot
+        {
+            std::atomic<KeyT>   key;
+            std::atomic<CountT> count;
+        };
+
+    public:
+        ConcurrentCountMap() = default;
+
+        explicit ConcurrentCountMap(size_t num_elems)
+        {
+            reserve(num_elems);
+        }
+
+        ConcurrentCountMap(const ConcurrentCountMap&) = delete;
+        ConcurrentCountMap& operator=(const ConcurrentCountMap&) = delete;
+
+        ~ConcurrentCountMap()
+        {
+            free(_slots);
+        }
+
+        /// Number of slots; scan [0, bucket_count()) with for_each().
+        size_t bucket_count() const
+        {
+            return _num_buckets;
+        }
+
+        /// Number of distinct keys added so far.
+        size_t size() const
+        {
+            return _num_filled.load(std::memory_order_relaxed);
+        }
+
+        /// Make room for this many distinct keys, discarding all contents. Not thread-safe:
+        /// call it before the table is shared.
+        void reserve(size_t num_elems)
+        {
+            if (!try_reserve(num_elems)) {
+                throw std::bad_alloc();
+            }
+        }
+
+        /// Same as above, but returns false, leaving the table as it was, if the slots cannot be allocated.
+        bool try_reserve(size_t num_elems)
+        {
+            if (num_elems > (SIZE_MAX / 4) / sizeof(Slot)) {
+                return false;
+            }
+            size_t required_buckets = num_elems + num_elems/2 + 1;
+            size_t num_buckets = 4;
+            while (num_buckets < required_buckets) { num_buckets *= 2; }
+
+            auto new_slots = (Slot*)malloc(num_buckets * sizeof(Slot));
+            if (!new_slots) {
+                return false;
+            }
+            for (size_t bucket=0; bucket<num_buckets; ++bucket) {
+                new(&new_slots[bucket].key) std::atomic<KeyT>(EmptyKey);
+                new(&new_slots[bucket].count) std::atomic<CountT>(0);
+            }
+
+            free(_slots);
+            _slots       = new_slots;
+            _num_buckets = num_buckets;
+            _mask        = num_buckets - 1;
+            _max_filled  = num_buckets - num_buckets/8;
+            _num_filled.store(0, std::memory_order_relaxed);
+            _empty_key_added.store(false, std::memory_order_relaxed);
+            _empty_key_count.store(0, std::memory_order_relaxed);
+            return true;
+        }
+
+        /// Free all slots.
+        void release()
+        {
+            free(_slots);
+            _slots       = nullptr;
+            _num_buckets = 0;
+            _mask        = 0;
+            _max_filled  = 0;
+            _num_filled.store(0, std::memory_order_relaxed);
+            _empty_key_added.store(false, std::memory_order_relaxed);
+            _empty_key_count.store(0, std::memory_order_relaxed);
+        }
+
+        /// Add n to the count of key, inserting it if needed. Safe to call from any number of threads.
+        /// Returns false, and changes nothing, if key is new and the table is full.
+        bool add(const KeyT& key, const CountT& n)
+        {
+            if (key == EmptyKey) {
+                if (!_empty_key_added.exchange(true, std::memory_order_relaxed)) {
+                    _num_filled.fetch_add(1, std::memory_order_relaxed);
+                }
+                _empty_key_count.fetch_add(n, std::memory_order_relaxed);
+                return true;
+            }
+            auto hash_value = _hasher(key);
+            for (size_t offset=0; offset<_num_buckets; ++offset) {
+                Slot& slot = _slots[(hash_value + offset) & _mask];
+                KeyT current = slot.key.load(std::memory_order_acquire);
+                if (current == EmptyKey) {
+                    if (_num_filled.load(std::memory_order_relaxed) >= _max_filled) {
+                        return false;
+                    }
+                    if (slot.key.compare_exchange_strong(current, key, std::memory_order_acq_rel)) {
+                        _num_filled.fetch_add(1, std::memory_order_relaxed);
+                        slot.count.fetch_add(n, std::memory_order_relaxed);
+                        return true;
+                    }
+                    // Lost the race for this slot: current now holds the key that won it
+                }
+                if (current == key) {
+                    slot.count.fetch_add(n, std::memory_order_relaxed);
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /// Count of key, or zero if it was never added.
+        CountT get(const KeyT& key) const
+        {
+            if (key == EmptyKey) {
+                return _empty_key_count.load(std::memory_order_relaxed);
+            }
+            auto hash_value = _hasher(key);
+            for (size_t offset=0; offset<_num_buckets; ++offset) {
+                const Slot& slot = _slots[(hash_value + offset) & _mask];
+                KeyT current = slot.key.load(std::memory_order_acquire);
+                if (current == key) {
+                    return slot.count.load(std::memory_order_relaxed);
+                }
+                if (current == EmptyKey) {
+                    return CountT();
+                }
+            }
+            return CountT();
+        }
+
+        /// Call fn(key, count) for every key in slots [begin, end). Disjoint ranges may be scanned
+        /// from different threads once all adds are done. EmptyKey has no slot and comes with the
+        /// range that starts at slot 0.
+        template <typename FnT>
+        void for_each(size_t begin, size_t end, FnT fn) const
+        {
+            if ((begin == 0) && _empty_key_added.load(std::memory_order_relaxed)) {
+                fn(EmptyKey, _empty_key_count.load(std::memory_order_relaxed));
+            }
+            for (size_t bucket=begin; bucket<end && bucket<_num_buckets; ++bucket) {
+                KeyT key = _slots[bucket].key.load(std::memory_order_relaxed);
+                if (key != EmptyKey) {
+                    fn(key, _slots[bucket].count.load(std::memory_order_relaxed));
+                }
+            }
+        }
+
+    private:
+        HashT               _hasher;
+        Slot*               _slots       = nullptr;
+        size_t              _num_buckets = 0;
+        size_t              _mask        = 0;  // _num_buckets minus one
+        size_t              _max_filled  = 0;  // add() refuses new keys past this many
+        std::atomic<size_t> _num_filled{0};
+        std::atomic<bool>   _empty_key_added{false};
+        std::atomic<CountT> _empty_key_count{0};
+    };
+    
 } // namespace emilib
@@ -13,18 +13,20 @@ main(int argc, char** argv)
 
     switch (kc.input_type) {
         case kmer_counter::KmerCounter::bedInput:
-            kc.initialize_kmer_map();
             kc.parse_bed_input_to_counts();
             break;
         case kmer_counter::KmerCounter::fastaInput:
             kc.parse_fasta_input_to_counts();
             break;
+        case kmer_counter::KmerCounter::fastqInput:
+            kc.parse_fastq_input_to_counts();
+            break;
         default:
             std::fprintf(stderr, "Undefined input type!\n");
             exit(EXIT_FAILURE);
     }
     
-    if (kc.map_keys)
+    if (kc.map_keys && kc.results_kmer_map_stream())
         kc.print_kmer_map(kc.results_kmer_map_stream());
         
     kc.close_output_streams();
@@ -36,347 +38,981 @@ void
 kmer_counter::KmerCounter::close_output_streams(void)
 {
     this->close_in_stream();
+    if (this->output_format == KmerCounter::csrOutput)
+        this->csr_writer.finish();
+    if (this->output_format == KmerCounter::npyOutput)
+        this->npy_writer.finish();
     this->close_kmer_count_stream();
     this->close_kmer_map_stream();
 }
 
 void
-kmer_counter::KmerCounter::initialize_kmer_map(void)
+kmer_counter::KmerCounter::print_kmer_map(FILE* os)
 {
-    int i = 0;
-    std::uint64_t x, y;
-    int k = this->k();
+    const int k = this->k();
+    const std::uint64_t n_mers = 1ULL << (2 * k);
+    std::string out;
     std::string mer;
 
-    // modified from: https://www.biostars.org/p/18096/#18107
-    mer.reserve(k);
-    for (x = 0; x < 1ULL<<(2*k); ++x) {
-        for (i = 0, y = x; i < k; ++i, y >>= 2)
-            mer.push_back("ACGT"[y & 3]);
-        this->set_mer_key(mer, this->offset(true));
-        mer.clear();
+    // mer-keys are arithmetic, offset plus the code with the first base in the lowest bits, so the
+    // map is written in ascending key order without building it
+    mer.resize(k);
+    for (std::uint64_t x = 0; x < n_mers; ++x) {
+        std::uint64_t y = x;
+        for (int i = 0; i < k; ++i, y >>= 2) {
+            mer[i] = "ACGT"[y & 3];
+        }
+        out.append(mer);
+        out.push_back('\t');
+        append_int(out, this->offset() + (std::int64_t) x);
+        out.push_back('\n');
+        if (out.length() >= KMER_COUNTER_WRITE_BLOCK) {
+            std::fwrite(out.data(), 1, out.length(), os);
+            out.clear();
+        }
     }
+    std::fwrite(out.data(), 1, out.length(), os);
 }
 
 void
-kmer_counter::KmerCounter::print_kmer_map(FILE* os)
+kmer_counter::KmerCounter::parse_bed_input_to_counts(void)
 {
-    auto map = this->mer_keys();
-    for (auto iter = map.begin(); iter != map.end(); ++iter) {
-        std::fprintf(os, "%s\t%d\n", iter->first.c_str(), iter->second);
-    }    
+    // byte-range shards need the whole input mapped
+    if ((this->threads() > 1) && this->input().mapped()) {
+        this->parse_bed_input_to_counts_parallel();
+        return;
+    }
+    this->parse_bed_range(this->input(), _count_state, this->results_kmer_count_stream());
+    if (this->aggregate) {
+        std::vector<KmerCountState*> states(1, &_count_state);
+        this->write_aggregate_counts(states);
+    }
 }
 
 void
-kmer_counter::KmerCounter::parse_bed_input_to_counts(void)
+kmer_counter::KmerCounter::parse_bed_input_to_counts_parallel(void)
 {
-    char* buf = NULL;
-    size_t buf_len = 0;
-    ssize_t buf_read = 0;
-    char chr_str[LINE_MAX];
-    char start_str[LINE_MAX];
-    char stop_str[LINE_MAX];
-    char* id_str = NULL;
-    std::string n("N");
-
-    id_str = (char*) malloc(KMER_COUNTER_LINE_MAX);
-    if (!id_str) {
-        std::fprintf(stderr, "Error: Could not allocate memory for ID buffer\n");
-        std::exit(ENOMEM);
-    }
-
-    while ((buf_read = getline(&buf, &buf_len, this->in_stream())) != EOF) {
-        std::sscanf(buf, "%s\t%s\t%s\t%s\n", chr_str, start_str, stop_str, id_str);
-        std::string seq(id_str);
-        std::transform(seq.begin(), seq.end(), seq.begin(), ::toupper);
-        std::deque<char> window(seq.begin(), seq.begin() + this->k());
-        // walk over all windows across sequence
-        for (size_t i = this->k(); i <= seq.length(); ++i) {
-            std::string mer_f(window.begin(), window.end());
-            window.pop_front();
-            window.push_back(seq[i]);
-            std::size_t n_found = mer_f.find(n);
-            if (n_found != std::string::npos) {
-                continue;
-            }
-            std::string mer_r(mer_f);
-            reverse_complement_string(mer_r);
-            if ((mer_count(mer_f) == 0) && (mer_count(mer_r) == 0)) {
-                set_mer_count(mer_f, 1);
-                // we don't want to add a palindrome twice
-                if ((mer_f.compare(mer_r) == 0) && (!this->double_count_palindromes)) {
-                    continue;
+    const int n_shards = this->threads();
+    const char* in_data = this->input().data();
+    const size_t in_size = this->input().size();
+    FILE* os = this->results_kmer_count_stream() ? this->results_kmer_count_stream() : stdout;
+    std::vector<size_t> bounds(n_shards + 1, 0);
+    std::vector<FILE*> fragments(n_shards, NULL);
+    std::vector<std::string> fragment_fns(n_shards);
+    std::vector<CsrWriter> csr_fragments(n_shards);
+    std::vector<KmerCountState> states(n_shards);
+    std::vector<std::thread> workers;
+
+    // split input into byte ranges that start on line boundaries
+    bounds[n_shards] = in_size;
+    for (int i = 1; i < n_shards; ++i) {
+        bounds[i] = next_line_start(in_data, in_size, std::max(bounds[i - 1], (in_size / n_shards) * i));
+    }
+
+    // dense rows go straight to their place in the matrix, so each range needs its first row number
+    std::vector<std::uint64_t> first_rows(n_shards + 1, 0);
+    if (this->output_format == KmerCounter::npyOutput) {
+        for (int i = 0; i < n_shards; ++i) {
+            workers.emplace_back([i, in_data, &bounds, &first_rows]() {
+                const char* line = NULL;
+                size_t line_len = 0;
+                InputReader shard;
+                shard.open(in_data + bounds[i], bounds[i + 1] - bounds[i]);
+                while (shard.next_line(line, line_len)) {
+                    first_rows[i + 1]++;
                 }
-                set_mer_count(mer_r, 1);
+            });
+        }
+        for (auto iter = workers.begin(); iter != workers.end(); ++iter) {
+            iter->join();
+        }
+        workers.clear();
+        for (int i = 0; i < n_shards; ++i) {
+            first_rows[i + 1] += first_rows[i];
+        }
+    }
+
+    // count each range on its own thread, into its own count.bed, sparse matrix fragment or dense rows
+    for (int i = 0; i < n_shards; ++i) {
+        if (this->output_format == KmerCounter::csrOutput) {
+            csr_fragments[i].open_fragment();
+        }
+        else if ((this->output_format == KmerCounter::textOutput) && !this->aggregate) {
+            if (!this->results_kmer_count_fn().empty()) {
+                fragment_fns[i] = this->results_kmer_count_fn() + ".shard-" + std::to_string(i);
+                fragments[i] = std::fopen(fragment_fns[i].c_str(), "w+");
+            }
+            else {
+                fragments[i] = tmpfile();
             }
-            else if ((mer_count(mer_f) == 1) || (mer_count(mer_r) == 1)) {
-                increment_mer_count(mer_f);
-                increment_mer_count(mer_r);
+            if (!fragments[i]) {
+                std::fprintf(stderr, "Error: Output file handle to count fragment could not be created\n");
+                std::exit(ENODATA); /* No message is available on the STREAM head read queue (POSIX.1) */
             }
         }
-        this->print_kmer_count(this->results_kmer_count_stream(), chr_str, start_str, stop_str);
+        workers.emplace_back([this, i, in_data, &bounds, &fragments, &csr_fragments, &first_rows, &states]() {
+            KmerCountState& state = states[i];
+            InputReader shard;
+            shard.open(in_data + bounds[i], bounds[i + 1] - bounds[i]);
+            this->initialize_count_state(state);
+            state.csr_writer = &csr_fragments[i];
+            state.row = first_rows[i];
+            this->parse_bed_range(shard, state, fragments[i]);
+        });
+    }
+    for (auto iter = workers.begin(); iter != workers.end(); ++iter) {
+        iter->join();
+    }
+
+    // join fragments in order
+    std::vector<char> block(1 << 20);
+    for (int i = 0; i < n_shards; ++i) {
+        size_t block_read = 0;
+        if (this->output_format == KmerCounter::csrOutput) {
+            this->csr_writer.append(csr_fragments[i]);
+        }
+        if (!fragments[i]) {
+            continue;
+        }
+        std::rewind(fragments[i]);
+        while ((block_read = std::fread(block.data(), 1, block.size(), fragments[i])) > 0) {
+            std::fwrite(block.data(), 1, block_read, os);
+        }
+        std::fclose(fragments[i]);
+        if (!fragment_fns[i].empty()) {
+            std::remove(fragment_fns[i].c_str());
+        }
+    }
+
+    if (this->aggregate) {
+        std::vector<KmerCountState*> state_ptrs;
+        for (auto iter = states.begin(); iter != states.end(); ++iter) {
+            state_ptrs.push_back(&*iter);
+        }
+        this->write_aggregate_counts(state_ptrs);
     }
+}
+
+void
+kmer_counter::KmerCounter::parse_bed_range(InputReader& reader, KmerCountState& state, FILE* os)
+{
+    const char* line = NULL;
+    size_t line_len = 0;
+    const char* chr = NULL;
+    const char* start = NULL;
+    const char* stop = NULL;
+    const char* id = NULL;
+    size_t chr_len = 0;
+    size_t start_len = 0;
+    size_t stop_len = 0;
+    size_t id_len = 0;
+    std::uint64_t start_pos = 0;
+    std::uint64_t stop_pos = 0;
+    ReferenceCursor reference_cursor;
+    const bool use_reference = this->reference().loaded();
 
-    // cleanup
-    free(buf);
-    free(id_str);
+    // fields are views into the line; the sequence is counted in place, or read from the reference
+    while (reader.next_line(line, line_len)) {
+        const char* cursor = line;
+        const char* end = line + line_len;
+        next_field(cursor, end, chr, chr_len);
+        next_field(cursor, end, start, start_len);
+        next_field(cursor, end, stop, stop_len);
+        if (use_reference) {
+            if (!parse_position(start, start_len, start_pos) || !parse_position(stop, stop_len, stop_pos)) {
+                std::fprintf(stderr, "Error: Interval [%.*s] does not have integer start and stop positions\n", (int) line_len, line);
+                std::exit(EINVAL);
+            }
+            this->begin_mers(state);
+            this->reference().fetch(reference_cursor, chr, chr_len, start_pos, stop_pos, [&](const char* piece, size_t piece_len) {
+                this->feed_mers(state, piece, piece_len);
+            });
+        }
+        else {
+            next_field(cursor, end, id, id_len);
+            this->count_mers(state, id, id_len);
+        }
+        this->print_kmer_count(os, state, chr, chr_len, start, start_len, stop, stop_len);
+    }
+    this->flush_kmer_count(os, state);
 }
 
 void
 kmer_counter::KmerCounter::parse_fasta_input_to_counts(void)
 {
-    char* buf = NULL;
-    size_t buf_len = 0;
-    ssize_t buf_read = 0;
-    char header_str[LINE_MAX] = {0};
-    char* sequence_str = NULL;
-    ssize_t sequence_read = 0;
-    char* sequence_intermediate_buf = NULL;
-    ssize_t line_count = 0;
+    if (this->threads() > 1) {
+        this->parse_records_to_counts_parallel();
+        return;
+    }
 
-    sequence_str = (char*) malloc(KMER_COUNTER_LINE_MAX);
-    if (!sequence_str) {
-        std::fprintf(stderr, "Error: Could not allocate memory for sequence buffer\n");
-        std::exit(ENOMEM);
+    // stream bases into the counter line by line; only the rolling window crosses line breaks
+    std::string header;
+    size_t record_len = 0;
+    this->stream_fasta_records(
+        [&](const char* h, size_t h_len) {
+            header.assign(h, h_len);
+            record_len = 0;
+            this->begin_mers(_count_state);
+        },
+        [&](const char* sequence, size_t sequence_len) {
+            this->feed_mers(_count_state, sequence, sequence_len);
+            record_len += sequence_len;
+        },
+        [&]() {
+            if (record_len > 0) {
+                this->print_kmer_count(this->results_kmer_count_stream(), header.data(), header.length());
+            }
+        });
+    this->flush_kmer_count(this->results_kmer_count_stream(), _count_state);
+    if (this->aggregate) {
+        std::vector<KmerCountState*> states(1, &_count_state);
+        this->write_aggregate_counts(states);
     }
+}
 
-    sequence_intermediate_buf = (char*) malloc(KMER_COUNTER_LINE_MAX);
-    if (!sequence_intermediate_buf) {
-        std::fprintf(stderr, "Error: Could not allocate memory for sequence intermediate buffer\n");
-        std::exit(ENOMEM);
+void
+kmer_counter::KmerCounter::parse_fastq_input_to_counts(void)
+{
+    if (this->threads() > 1) {
+        this->parse_records_to_counts_parallel();
+        return;
     }
 
-    while ((buf_read = getline(&buf, &buf_len, this->in_stream())) != EOF) {
-        if (buf[0] == '>') {
-            if ((strlen(header_str) > 0) && (strlen(sequence_str) > 0)) {
-                this->process_fasta_record(header_str, sequence_str);
-                sequence_read = 0;
+    // same kernel and per-record output as FASTA, with low-quality bases masked out
+    this->read_fastq_records([this](const char* header, size_t header_len, const char* sequence, size_t sequence_len, const char* quality) {
+        this->count_mers(_count_state, sequence, sequence_len, quality);
+        this->print_kmer_count(this->results_kmer_count_stream(), header, header_len);
+    });
+    this->flush_kmer_count(this->results_kmer_count_stream(), _count_state);
+    if (this->aggregate) {
+        std::vector<KmerCountState*> states(1, &_count_state);
+        this->write_aggregate_counts(states);
+    }
+}
+
+void
+kmer_counter::KmerCounter::parse_records_to_counts_parallel(void)
+{
+    struct FastaBatch {
+        size_t index;
+        std::vector<std::string> headers;
+        std::vector<const char*> sequences;
+        std::vector<size_t> sequence_lens;
+        std::vector<const char*> qualities;
+        std::deque<std::string> sequence_copies;
+        size_t sequence_len = 0;
+        bool split = false;
+        std::string output;
+        CsrBlock csr;
+        std::uint64_t first_row = 0;
+    };
+    const size_t batch_sequence_len = 1 << 22;
+    const size_t batch_records = 4096;
+    const int n_workers = this->threads();
+    OrderedBatchQueue<FastaBatch> queue(4 * n_workers);
+    FILE* os = this->results_kmer_count_stream() ? this->results_kmer_count_stream() : stdout;
+
+    // workers count records with private state and format their lines
+    std::vector<KmerCountState> states(n_workers);
+    std::vector<std::thread> workers;
+    for (int i = 0; i < n_workers; ++i) {
+        workers.emplace_back([this, i, &queue, &states]() {
+            KmerCountState& state = states[i];
+            this->initialize_count_state(state);
+            while (std::unique_ptr<FastaBatch> batch = queue.take()) {
+                state.row = batch->first_row;
+                for (size_t j = 0; j < batch->headers.size(); ++j) {
+                    if (batch->split) {
+                        this->count_mers_parallel(state, batch->sequences[j], batch->sequence_lens[j], batch->qualities[j]);
+                    }
+                    else {
+                        this->count_mers(state, batch->sequences[j], batch->sequence_lens[j], batch->qualities[j]);
+                    }
+                    if (this->aggregate) {
+                        continue;
+                    }
+                    if (this->output_format == KmerCounter::csrOutput) {
+                        this->append_csr_row(state);
+                        continue;
+                    }
+                    if (this->output_format == KmerCounter::npyOutput) {
+                        this->append_npy_row(state);
+                        continue;
+                    }
+                    batch->output.append(">").append(batch->headers[j]).append("\t");
+                    this->format_kmer_count(state, batch->output);
+                    this->reset_record_counts(state);
+                    batch->output.push_back('\n');
+                }
+                std::swap(batch->csr, state.csr);
+                queue.finish(std::move(batch));
+            }
+        });
+    }
+
+    // writer emits batches in input order
+    std::thread writer([this, &queue, os]() {
+        while (std::unique_ptr<FastaBatch> batch = queue.next_finished()) {
+            std::fwrite(batch->output.data(), 1, batch->output.length(), os);
+            if (this->output_format == KmerCounter::csrOutput) {
+                this->csr_writer.append(batch->csr);
             }
-            // read in next header
-            std::sscanf(buf, ">%[^\n\t]\n", header_str);
         }
-        else {
-            std::sscanf(buf, "%s\n", sequence_intermediate_buf);
-            std::memcpy(sequence_str + sequence_read, sequence_intermediate_buf, buf_read);
-            sequence_read += (buf_read - 1);
-            if (sequence_read >= KMER_COUNTER_LINE_MAX) {
-                std::fprintf(stderr, "Error: Input FASTA record is longer than can be stored in the sequence buffer\n");
-                std::exit(EOVERFLOW);
+    });
+
+    // reader slices records into batches
+    std::unique_ptr<FastaBatch> batch(new FastaBatch);
+    std::uint64_t records = 0;
+    auto add_record = [&](const char* header, size_t header_len, const char* sequence, size_t sequence_len, const char* quality) {
+        // sequences are views into a mapped input; only streamed or multi-line ones are copied
+        if (batch->headers.empty()) {
+            batch->first_row = records;
+        }
+        records++;
+        batch->headers.emplace_back(header, header_len);
+        if (!this->input().stable(sequence)) {
+            batch->sequence_copies.emplace_back(sequence, sequence_len);
+            sequence = batch->sequence_copies.back().data();
+        }
+        if (quality && !this->input().stable(quality)) {
+            batch->sequence_copies.emplace_back(quality, sequence_len);
+            quality = batch->sequence_copies.back().data();
+        }
+        batch->sequences.push_back(sequence);
+        batch->sequence_lens.push_back(sequence_len);
+        batch->qualities.push_back(quality);
+        batch->sequence_len += sequence_len;
+    };
+    auto on_record = [&](const char* header, size_t header_len, const char* sequence, size_t sequence_len, const char* quality) {
+        if (sequence_len >= 2 * KMER_COUNTER_CHUNK_MIN_LEN) {
+            // a chromosome-scale record travels alone and is counted across threads in chunks
+            if (!batch->headers.empty()) {
+                queue.push(std::move(batch));
+                batch.reset(new FastaBatch);
             }
+            batch->split = true;
+            add_record(header, header_len, sequence, sequence_len, quality);
+            queue.push(std::move(batch));
+            batch.reset(new FastaBatch);
+            return;
+        }
+        add_record(header, header_len, sequence, sequence_len, quality);
+        if ((batch->sequence_len >= batch_sequence_len) || (batch->headers.size() >= batch_records)) {
+            queue.push(std::move(batch));
+            batch.reset(new FastaBatch);
         }
-        line_count += 1;
+    };
+    if (this->input_type == KmerCounter::fastqInput) {
+        this->read_fastq_records(on_record);
+    }
+    else {
+        this->read_fasta_records([&](const char* header, size_t header_len, const char* sequence, size_t sequence_len) {
+            on_record(header, header_len, sequence, sequence_len, NULL);
+        });
     }
+    if (!batch->headers.empty()) {
+        queue.push(std::move(batch));
+    }
+    queue.close();
 
-    // process final record
-    if ((strlen(header_str) > 0) && (strlen(sequence_str) > 0)) {
-        this->process_fasta_record(header_str, sequence_str);
-        sequence_read = 0;
+    for (auto iter = workers.begin(); iter != workers.end(); ++iter) {
+        iter->join();
     }
+    writer.join();
 
-    // cleanup
-    free(buf);
-    free(sequence_str);
-    free(sequence_intermediate_buf);
+    if (this->aggregate) {
+        std::vector<KmerCountState*> state_ptrs;
+        for (auto iter = states.begin(); iter != states.end(); ++iter) {
+            state_ptrs.push_back(&*iter);
+        }
+        this->write_aggregate_counts(state_ptrs);
+    }
 }
 
 void
-kmer_counter::KmerCounter::process_fasta_record(char* header, char* sequence)
+kmer_counter::KmerCounter::read_fasta_records(const std::function<void(const char*, size_t, const char*, size_t)>& on_record)
 {
-    std::string seq(sequence);
-    std::string n("N");
+    std::string header;
+    const char* sequence = NULL;
+    size_t sequence_len = 0;
+    std::string wrapped_sequence;
+    int sequence_parts = 0;
 
-    std::transform(seq.begin(), seq.end(), seq.begin(), ::toupper);
-    std::deque<char> window(seq.begin(), seq.begin() + this->k());
-    // walk over all windows across sequence
-    for (size_t i = this->k(); i <= seq.length(); ++i) {
-        std::string mer_f(window.begin(), window.end());
-        #ifdef DEBUG
-        std::fprintf(stderr, "[%s]\n", mer_f.c_str());
-        #endif
-        window.pop_front();
-        window.push_back(seq[i]);
-        std::size_t n_found = mer_f.find(n);
-        if (n_found != std::string::npos) {
-            continue;
-        }
-        std::string mer_r(mer_f);
-        reverse_complement_string(mer_r);
-        #ifdef DEBUG
-        std::fprintf(stderr, "PRE  [%s : %d]\t[%s : %d]\n", mer_f.c_str(), (mer_count(mer_f) == 0 ? 0 : this->mer_counts().find(mer_f)->second), mer_r.c_str(), (mer_count(mer_r) == 0 ? 0 : this->mer_counts().find(mer_r)->second));
-        #endif
-        if ((mer_count(mer_f) == 0) && (mer_count(mer_r) == 0)) {
-            #ifdef DEBUG
-            std::fprintf(stderr, "INITIALIZING [%s]\n", mer_f.c_str());
-            #endif
-            set_mer_count(mer_f, 1);
-            // we don't want to add a palindrome twice
-            if ((mer_f.compare(mer_r) == 0) && (!this->double_count_palindromes)) {
-                #ifdef DEBUG
-                std::fprintf(stderr, "POST %d [%s : %d]\t[%s : %d]\n-----------------\n", (this->double_count_palindromes ? 1 : 0), mer_f.c_str(), (mer_count(mer_f) == 0 ? 0 : this->mer_counts().find(mer_f)->second), mer_r.c_str(), (mer_count(mer_r) == 0 ? 0 : this->mer_counts().find(mer_r)->second));
-                #endif
-                continue;
+    // a one-line sequence is handed on as a view into the input; wrapped lines are joined
+    this->stream_fasta_records(
+        [&](const char* h, size_t h_len) {
+            header.assign(h, h_len);
+            sequence_len = 0;
+            sequence_parts = 0;
+        },
+        [&](const char* part, size_t part_len) {
+            if ((sequence_parts == 0) && this->input().stable(part)) {
+                sequence = part;
             }
-            #ifdef DEBUG
-            std::fprintf(stderr, "INITIALIZING [%s]\n", mer_r.c_str());
-            #endif
-            if (mer_count(mer_r) == 0) {
-                set_mer_count(mer_r, 1);  
+            else {
+                // streamed lines do not outlive the next read, so they are copied too
+                if (sequence_parts == 0) {
+                    wrapped_sequence.clear();
+                }
+                else if (sequence != wrapped_sequence.data()) {
+                    wrapped_sequence.assign(sequence, sequence_len);
+                }
+                wrapped_sequence.append(part, part_len);
+                sequence = wrapped_sequence.data();
             }
-            else if (this->double_count_palindromes) {
-                increment_mer_count(mer_r);
+            sequence_len += part_len;
+            sequence_parts++;
+        },
+        [&]() {
+            if (sequence_len > 0) {
+                on_record(header.data(), header.length(), sequence, sequence_len);
             }
+        });
+}
+
+void
+kmer_counter::KmerCounter::stream_fasta_records(const std::function<void(const char*, size_t)>& on_header,
+                                                const std::function<void(const char*, size_t)>& on_sequence,
+                                                const std::function<void(void)>& on_record_end)
+{
+    const char* part = NULL;
+    size_t part_len = 0;
+    bool line_end = true;
+    bool line_start = true;
+    bool in_header = false;
+    bool in_record = false;
+    std::string header;
+
+    // lines arrive in parts no longer than the read buffer; a header is gathered whole
+    while (this->input().next_line_part(part, part_len, line_end)) {
+        if (line_end && (part_len > 0) && (part[part_len - 1] == '\r')) {
+            part_len--;
         }
-        else if ((mer_count(mer_f) == 1) || (mer_count(mer_r) == 1)) {
-            #ifdef DEBUG
-            std::fprintf(stderr, "INCREMENTING [%s]\n", mer_f.c_str());
-            #endif
-            increment_mer_count(mer_f);
-            if ((mer_f.compare(mer_r) == 0) && (!this->double_count_palindromes)) {
-                #ifdef DEBUG
-                std::fprintf(stderr, "POST %d [%s : %d]\t[%s : %d]\n-----------------\n", (this->double_count_palindromes ? 1 : 0), mer_f.c_str(), (mer_count(mer_f) == 0 ? 0 : this->mer_counts().find(mer_f)->second), mer_r.c_str(), (mer_count(mer_r) == 0 ? 0 : this->mer_counts().find(mer_r)->second));
-                #endif
-                continue;
+        if (line_start && (part_len > 0) && (part[0] == '>')) {
+            if (in_record) {
+                on_record_end();
             }
-            #ifdef DEBUG
-            std::fprintf(stderr, "INCREMENTING [%s]\n", mer_r.c_str());
-            #endif
-            increment_mer_count(mer_r);
+            header.clear();
+            in_header = true;
+            part++;
+            part_len--;
         }
-        #ifdef DEBUG
-        std::fprintf(stderr, "POST [%s : %d]\t[%s : %d]\n-----------------\n", mer_f.c_str(), (mer_count(mer_f) == 0 ? 0 : this->mer_counts().find(mer_f)->second), mer_r.c_str(), (mer_count(mer_r) == 0 ? 0 : this->mer_counts().find(mer_r)->second));
-        #endif
+        if (in_header) {
+            header.append(part, part_len);
+            if (line_end) {
+                // header runs up to the first tab
+                on_header(header.data(), std::min(header.find('\t'), header.length()));
+                in_header = false;
+                in_record = true;
+            }
+        }
+        else if (in_record && (part_len > 0)) {
+            on_sequence(part, part_len);
+        }
+        line_start = line_end;
     }
 
-    this->print_kmer_count(this->results_kmer_count_stream(), header);
+    // process final record
+    if (in_header) {
+        on_header(header.data(), std::min(header.find('\t'), header.length()));
+        in_record = true;
+    }
+    if (in_record) {
+        on_record_end();
+    }
 }
 
 void
-kmer_counter::KmerCounter::print_kmer_count(FILE* os, char header[])
+kmer_counter::KmerCounter::read_fastq_records(const std::function<void(const char*, size_t, const char*, size_t, const char*)>& on_record)
 {
-    char kv_pair[LINE_MAX];
-    std::string kv_pairs;
+    const char* line = NULL;
+    size_t line_len = 0;
+    std::string header;
+    const char* sequence = NULL;
+    size_t sequence_len = 0;
+    std::string sequence_copy;
 
-    if (!os)
-        os = stdout;
+    // four-line records: @header, sequence, +[header], quality
+    auto next_record_line = [&](void) {
+        if (!this->input().next_line(line, line_len)) {
+            std::fprintf(stderr, "Error: Input FASTQ record is truncated\n");
+            std::exit(EIO);
+        }
+        if ((line_len > 0) && (line[line_len - 1] == '\r')) {
+            line_len--;
+        }
+    };
 
-    // filter, if we do not want to print reverse complement hits
-    std::vector<std::string> mer_keys;
-    std::vector<std::string> mer_keys_to_remove;
-    for (auto iter = this->mer_counts().begin(); iter != this->mer_counts().end(); ++iter) {
-        std::string test_key = iter->first;
-        std::string rc_mer_key(test_key);
-        reverse_complement_string(rc_mer_key);
-        if ((!this->write_reverse_complement) && (test_key.compare(rc_mer_key) != 0)) {
-            auto found = std::find(mer_keys.begin(), mer_keys.end(), rc_mer_key);
-            if (found == mer_keys.end()) {
-                mer_keys_to_remove.push_back(rc_mer_key);
-            }
+    while (this->input().next_line(line, line_len)) {
+        if ((line_len > 0) && (line[line_len - 1] == '\r')) {
+            line_len--;
+        }
+        if (line_len == 0) {
+            continue;
+        }
+        if (line[0] != '@') {
+            std::fprintf(stderr, "Error: Input FASTQ record does not start with '@'\n");
+            std::exit(EIO);
+        }
+        // header runs up to the first tab
+        const char* tab = static_cast<const char*>(memchr(line + 1, '\t', line_len - 1));
+        header.assign(line + 1, tab ? (size_t) (tab - line - 1) : line_len - 1);
+
+        // a streamed sequence line does not outlive the reads of the next two lines
+        next_record_line();
+        sequence = line;
+        sequence_len = line_len;
+        if (!this->input().stable(sequence)) {
+            sequence_copy.assign(line, line_len);
+            sequence = sequence_copy.data();
         }
-        mer_keys.push_back(test_key);
+
+        next_record_line();
+        if ((line_len == 0) || (line[0] != '+')) {
+            std::fprintf(stderr, "Error: Input FASTQ record has no '+' separator line\n");
+            std::exit(EIO);
+        }
+
+        next_record_line();
+        if (line_len != sequence_len) {
+            std::fprintf(stderr, "Error: Input FASTQ record has quality and sequence of different lengths\n");
+            std::exit(EIO);
+        }
+        on_record(header.data(), header.length(), sequence, sequence_len, line);
     }
-    for (auto iter = mer_keys_to_remove.begin(); iter != mer_keys_to_remove.end(); ++iter) {
-        std::string erase_key = *iter;
-        #ifdef DEBUG
-        std::fprintf(stderr, "REMOVING [%s]\n", erase_key.c_str());
-        #endif
-        this->erase_mer_count(erase_key);
-    }
-
-    // swap keys for canonical, unless specified
-    if (this->write_canonical) {
-        for (auto iter = this->mer_counts().begin(); iter != this->mer_counts().end(); ++iter) {
-            std::string test_key = iter->first;
-            std::string rc_mer_key(test_key);
-            reverse_complement_string(rc_mer_key);
-            if (std::lexicographical_compare(rc_mer_key.begin(), rc_mer_key.end(), test_key.begin(), test_key.end())) {
-                #ifdef DEBUG
-                std::fprintf(stderr, "SWAPPING [%s] FOR [%s]\n", test_key.c_str(), rc_mer_key.c_str());
-                #endif
-                int test_key_count = iter->second;
-                set_mer_count(rc_mer_key, test_key_count);
-                this->erase_mer_count(test_key);
+}
+
+void
+kmer_counter::KmerCounter::initialize_count_state(KmerCountState& state)
+{
+    if (this->k() <= KmerCounter::max_packed_k) {
+        state.mer_code_counts.initialize(this->k(), this->dense_max());
+        if (this->shared_counts.bucket_count() > 0) {
+            state.mer_code_counts.share(&this->shared_counts);
+        }
+    }
+}
+
+void
+kmer_counter::KmerCounter::count_mers(KmerCountState& state, const char* sequence, size_t sequence_len, const char* quality)
+{
+    this->begin_mers(state);
+    this->feed_mers(state, sequence, sequence_len, quality);
+}
+
+void
+kmer_counter::KmerCounter::begin_mers(KmerCountState& state)
+{
+    state.mer_f = 0;
+    state.mer_r = 0;
+    state.valid_len = 0;
+    state.mer_carry.clear();
+}
+
+void
+kmer_counter::KmerCounter::feed_mers(KmerCountState& state, const char* sequence, size_t sequence_len, const char* quality)
+{
+    // continue the current sequence in blocks, so encode buffers stay bounded
+    for (size_t block_start = 0; block_start < sequence_len; block_start += KMER_COUNTER_READ_BLOCK) {
+        const size_t block_len = std::min(sequence_len - block_start, (size_t) KMER_COUNTER_READ_BLOCK);
+        const char* block_quality = quality ? quality + block_start : NULL;
+        if (this->k() <= KmerCounter::max_packed_k) {
+            (this->*_count_mer_codes)(state, sequence + block_start, block_len, block_quality);
+        }
+        else {
+            this->count_mer_strings(state, sequence + block_start, block_len, block_quality);
+        }
+    }
+}
+
+void
+kmer_counter::KmerCounter::count_mers_parallel(KmerCountState& state, const char* sequence, size_t sequence_len, const char* quality)
+{
+    const size_t k = (size_t) this->k();
+    const bool packed = (this->k() <= KmerCounter::max_packed_k);
+    size_t n_chunks = std::min((size_t) this->threads(), sequence_len / KMER_COUNTER_CHUNK_MIN_LEN);
+    size_t span = sequence_len;
+
+    // keep all partial tables of one record within a memory budget; shared tables hold nothing
+    if (packed && state.mer_code_counts.dense()) {
+        // a dense partial holds a count and up to one touched entry for every code, however little it counts
+        n_chunks = std::min(n_chunks, (size_t) (KMER_COUNTER_PARTIAL_MEMORY / ((KmerCounter::mer_code_mask(this->k()) + 1) * 2 * sizeof(std::uint64_t))));
+    }
+    else if (!packed || (this->shared_counts.bucket_count() == 0)) {
+        // a sparse partial grows with the windows it counts, so bound the windows per round instead
+        const size_t entry_bytes = packed ? 64 : 160 + 2 * k;
+        span = std::max((size_t) KMER_COUNTER_READ_BLOCK, KMER_COUNTER_PARTIAL_MEMORY / (std::max(n_chunks, (size_t) 1) * entry_bytes));
+    }
+    if ((n_chunks < 2) || (sequence_len < k)) {
+        this->count_mers(state, sequence, sequence_len, quality);
+        return;
+    }
+
+    std::vector<KmerCountState> partials(n_chunks);
+    for (auto iter = partials.begin(); iter != partials.end(); ++iter) {
+        this->initialize_count_state(*iter);
+    }
+    const size_t round_max = (span > sequence_len / n_chunks) ? sequence_len : n_chunks * span;
+    for (size_t round_start = 0; round_start < sequence_len; round_start += round_max) {
+        const size_t round_len = std::min(sequence_len - round_start, round_max);
+
+        // chunk i owns the windows starting in [start_i, start_i+1) and reads k-1 bases past its end
+        std::vector<std::thread> workers;
+        for (size_t i = 0; i < n_chunks; ++i) {
+            const size_t start = round_start + (round_len * i / n_chunks);
+            const size_t stop = std::min(sequence_len, round_start + (round_len * (i + 1) / n_chunks) + k - 1);
+            workers.emplace_back([this, &partials, i, sequence, quality, start, stop]() {
+                this->count_mers(partials[i], sequence + start, stop - start, quality ? quality + start : NULL);
+            });
+        }
+
+        // merging in chunk order reproduces the serial first-seen order and orientation; each
+        // partial is merged and emptied as soon as its chunk is done, while later chunks still run
+        for (size_t i = 0; i < n_chunks; ++i) {
+            workers[i].join();
+            this->merge_count_state(state, partials[i]);
+            this->reset_record_counts(partials[i]);
+        }
+    }
+}
+
+void
+kmer_counter::KmerCounter::merge_count_state(KmerCountState& state, const KmerCountState& partial)
+{
+    if (this->k() <= KmerCounter::max_packed_k) {
+        state.mer_code_counts.merge(partial.mer_code_counts);
+        return;
+    }
+    std::string mer_r;
+    for (auto iter = partial.mer_touched.begin(); iter != partial.mer_touched.end(); ++iter) {
+        const size_t len = iter->length();
+        reverse_complement_string(iter->data(), len, mer_r);
+        const char* mer_c = (std::memcmp(iter->data(), mer_r.data(), len) <= 0) ? iter->data() : mer_r.data();
+        emilib::HashMapStringRef key = { mer_c, len };
+        state.increment_mer_count(mer_c, iter->data(), len, partial.mer_counts.find_with_hash(key, partial.mer_counts.hash_of(key))->second);
+    }
+}
+
+void
+kmer_counter::KmerCounter::reset_record_counts(KmerCountState& state)
+{
+    // only the slots touched by the current record need to be reset
+    if (this->k() <= KmerCounter::max_packed_k) {
+        state.mer_code_counts.clear();
+    }
+    else {
+        if (state.mer_touched.size() >= state.mer_counts.bucket_count() / 4) {
+            // most of the table was touched (say, a chunk partial), so one sweep is cheaper than erasing key by key
+            state.mer_counts.clear();
+        }
+        else {
+            std::string mer_r;
+            for (auto iter = state.mer_touched.begin(); iter != state.mer_touched.end(); ++iter) {
+                mer_r = *iter;
+                reverse_complement_string(mer_r);
+                state.mer_counts.erase(std::min(*iter, mer_r));
             }
         }
+        state.mer_touched.clear();
     }
+}
 
-    // write the hits
-    kv_pairs.clear();
-    for (auto iter = mer_keys.begin(); iter != mer_keys.end(); ++iter) {
-        std::string mer_key = *iter;
-        auto mer_key_lookup = this->mer_counts().find(mer_key);
-        int mer_key_count = (mer_key_lookup == this->mer_counts().end()) ? 0 : mer_key_lookup->second;
-        if (mer_key_count != 0) {
-            if (this->map_keys)
-                std::sprintf(kv_pair, "%d:%d ", this->mer_key(mer_key), mer_key_count);
-            else 
-                std::sprintf(kv_pair, "%s:%d ", mer_key.c_str(), mer_key_count);
-            set_mer_count(mer_key, 0);
-            kv_pairs.append(kv_pair);
+void
+kmer_counter::KmerCounter::count_mer_strings(KmerCountState& state, const char* sequence, size_t sequence_len, const char* quality)
+{
+    const size_t k = (size_t) this->k();
+    std::string seq(state.mer_carry);
+
+    // prefix the last k-1 bases of the previous piece, so no window is lost at the join
+    seq.append(sequence, sequence_len);
+    std::transform(seq.begin() + state.mer_carry.length(), seq.end(), seq.begin() + state.mer_carry.length(), ::toupper);
+    if (quality && (this->min_qual() > 0)) {
+        for (size_t i = 0; i < sequence_len; ++i) {
+            if (quality[i] - 33 < this->min_qual()) {
+                seq[state.mer_carry.length() + i] = 'N';
+            }
         }
     }
-    if (kv_pairs.length() > 0) {
-        kv_pairs.pop_back();
+    state.mer_carry.assign(seq, seq.length() - std::min(seq.length(), k - 1), std::string::npos);
+    // walk over all windows across sequence, skipping any that hold a non-ACGT base, as the packed path does
+    const unsigned char* base_codes = base_code_map();
+    std::string mer_r;
+    size_t clean_len = 0;
+    for (size_t i = 0; i < seq.length(); ++i) {
+        clean_len = (base_codes[(unsigned char) seq[i]] > 3) ? 0 : clean_len + 1;
+        if (clean_len < k) {
+            continue;
+        }
+        const char* mer_f = seq.data() + i + 1 - k;
+        #ifdef DEBUG
+        std::fprintf(stderr, "[%.*s]\n", (int) k, mer_f);
+        #endif
+        reverse_complement_string(mer_f, k, mer_r);
+        // count under the canonical (lesser) key; a palindrome is counted once, unless asked to
+        int c = std::memcmp(mer_f, mer_r.data(), k);
+        state.increment_mer_count((c <= 0) ? mer_f : mer_r.data(), mer_f, k, ((c == 0) && this->double_count_palindromes) ? 2 : 1);
     }
+}
 
-    std::fprintf(os, ">%s\t%s\n", header, kv_pairs.c_str());    
+void
+kmer_counter::KmerCounter::print_kmer_count(FILE* os, const char* header, size_t header_len)
+{
+    std::string& out = _count_state.output;
+
+    if (this->aggregate) {
+        // whole-input counts keep accumulating across records
+        return;
+    }
+    if (this->output_format == KmerCounter::npyOutput) {
+        this->append_npy_row(_count_state);
+        return;
+    }
+    if (this->output_format == KmerCounter::csrOutput) {
+        this->append_csr_row(_count_state);
+        if (_count_state.csr.keys.length() >= KMER_COUNTER_WRITE_BLOCK) {
+            this->flush_kmer_count(os, _count_state);
+        }
+        return;
+    }
+    out.push_back('>');
+    out.append(header, header_len);
+    out.push_back('\t');
+    this->format_kmer_count(_count_state, out);
+    out.push_back('\n');
+    this->reset_record_counts(_count_state);
+    if (out.length() >= KMER_COUNTER_WRITE_BLOCK) {
+        this->flush_kmer_count(os, _count_state);
+    }
 }
 
 void
-kmer_counter::KmerCounter::print_kmer_count(FILE* os, char chr[], char start[], char stop[])
+kmer_counter::KmerCounter::print_kmer_count(FILE* os, KmerCountState& state, const char* chr, size_t chr_len, const char* start, size_t start_len, const char* stop, size_t stop_len)
 {
-    char kv_pair[LINE_MAX];
-    std::string kv_pairs;
+    std::string& out = state.output;
+
+    if (this->aggregate) {
+        return;
+    }
+    if (this->output_format == KmerCounter::npyOutput) {
+        this->append_npy_row(state);
+        return;
+    }
+    if (this->output_format == KmerCounter::csrOutput) {
+        this->append_csr_row(state);
+        if (state.csr.keys.length() >= KMER_COUNTER_WRITE_BLOCK) {
+            this->flush_kmer_count(os, state);
+        }
+        return;
+    }
+    out.append(chr, chr_len);
+    out.push_back('\t');
+    out.append(start, start_len);
+    out.push_back('\t');
+    out.append(stop, stop_len);
+    out.push_back('\t');
+    this->format_kmer_count(state, out);
+    out.push_back('\n');
+    this->reset_record_counts(state);
+    if (out.length() >= KMER_COUNTER_WRITE_BLOCK) {
+        this->flush_kmer_count(os, state);
+    }
+}
 
+void
+kmer_counter::KmerCounter::flush_kmer_count(FILE* os, KmerCountState& state)
+{
+    // lines are written in blocks of several megabytes, not one call per record
     if (!os)
         os = stdout;
 
-    // filter, if we do not want to print reverse complement hits
-    std::vector<std::string> mer_keys;
-    std::vector<std::string> mer_keys_to_remove;
-    for (auto iter = this->mer_counts().begin(); iter != this->mer_counts().end(); ++iter) {
-        std::string test_key = iter->first;
-        std::string rc_mer_key(test_key);
-        reverse_complement_string(rc_mer_key);
-        if ((!this->write_reverse_complement) && (test_key.compare(rc_mer_key) != 0)) {
-            auto found = std::find(mer_keys.begin(), mer_keys.end(), rc_mer_key);
-            if (found == mer_keys.end()) {
-                mer_keys_to_remove.push_back(rc_mer_key);
+    if (!state.output.empty()) {
+        std::fwrite(state.output.data(), 1, state.output.length(), os);
+        state.output.clear();
+    }
+    if (state.csr_writer && !state.csr.row_nnz.empty()) {
+        state.csr_writer->append(state.csr);
+    }
+}
+
+void
+kmer_counter::KmerCounter::append_csr_row(KmerCountState& state)
+{
+    std::uint64_t nnz = 0;
+
+    this->for_each_kmer_key(state, [&](const std::uint64_t& key, const std::uint64_t& count) {
+        CsrWriter::append_entry(state.csr, key, count);
+        nnz++;
+    });
+    state.csr.row_nnz.push_back(nnz);
+    this->reset_record_counts(state);
+}
+
+void
+kmer_counter::KmerCounter::append_npy_row(KmerCountState& state)
+{
+    const int k = this->k();
+    std::vector<std::uint32_t>& row = state.dense_row;
+
+    // fill the touched columns of a zeroed row, write it, then zero them again
+    row.resize(1ULL << (2 * k), 0);
+    this->for_each_kmer_code(state, [&](const std::uint64_t& code, const std::uint64_t& count) {
+        if (count > UINT32_MAX) {
+            std::fprintf(stderr, "Error: A k-mer count of %" PRIu64 " does not fit the uint32 NPY matrix\n", count);
+            std::exit(ERANGE);
+        }
+        row[mer_map_index(code, k)] = (std::uint32_t) count;
+    });
+    this->npy_writer.write_row(state.row++, row.data());
+    this->for_each_kmer_code(state, [&](const std::uint64_t& code, const std::uint64_t&) {
+        row[mer_map_index(code, k)] = 0;
+    });
+    this->reset_record_counts(state);
+}
+
+void
+kmer_counter::KmerCounter::write_aggregate_counts(std::vector<KmerCountState*>& states)
+{
+    const int k = this->k();
+    std::vector<std::thread> workers;
+
+    // one table over the whole input: each thread's counts, keyed by canonical k-mer, merged in parallel
+    if (k <= KmerCounter::max_packed_k) {
+        std::vector<std::vector<std::pair<std::uint64_t, std::uint64_t>>> entries;
+        if (this->shared_counts.bucket_count() > 0) {
+            // threads counted into one shared table: split its slots between them instead
+            const size_t n_slots = this->shared_counts.bucket_count();
+            const size_t n_ranges = (size_t) this->threads();
+            entries.resize(n_ranges);
+            for (size_t i = 0; i < n_ranges; ++i) {
+                workers.emplace_back([this, &entries, i, n_slots, n_ranges]() {
+                    this->shared_counts.for_each(n_slots * i / n_ranges, n_slots * (i + 1) / n_ranges, [&](const std::uint64_t& code, const std::uint64_t& count) {
+                        entries[i].emplace_back(code, count);
+                    });
+                });
+            }
+        }
+        else {
+            entries.resize(states.size());
+            for (size_t i = 0; i < states.size(); ++i) {
+                workers.emplace_back([&states, &entries, i]() {
+                    states[i]->mer_code_counts.for_each([&](const std::uint64_t& code, const std::uint64_t& rc_code, const std::uint64_t& count) {
+                        entries[i].emplace_back(std::min(code, rc_code), count);
+                    });
+                    *states[i] = KmerCountState();
+                });
             }
         }
-        mer_keys.push_back(test_key);
+        for (auto iter = workers.begin(); iter != workers.end(); ++iter) {
+            iter->join();
+        }
+        this->shared_counts.release();
+        std::string mer;
+        this->write_aggregate_table(entries, [this, k, mer](std::string& out, const std::uint64_t& code, const std::uint64_t& count) mutable {
+            const std::uint64_t rc_code = reverse_complement_code(code, k);
+            for (int i = 0; i < ((this->write_reverse_complement && (code != rc_code)) ? 2 : 1); ++i) {
+                if (this->map_keys) {
+                    append_int(out, this->mer_key(i ? rc_code : code));
+                }
+                else {
+                    decode_mer_code(i ? rc_code : code, k, mer);
+                    out.append(mer);
+                }
+                out.push_back('\t');
+                append_uint(out, count);
+                out.push_back('\n');
+            }
+        });
+        return;
     }
-    for (auto iter = mer_keys_to_remove.begin(); iter != mer_keys_to_remove.end(); ++iter) {
-        std::string erase_key = *iter;
-        this->erase_mer_count(erase_key);
-        std::fprintf(stderr, "erased [%s]\n", erase_key.c_str());
+    std::vector<std::vector<std::pair<std::string, std::uint64_t>>> entries(states.size());
+    for (size_t i = 0; i < states.size(); ++i) {
+        workers.emplace_back([&states, &entries, i]() {
+            std::string mer_r;
+            for (auto iter = states[i]->mer_touched.begin(); iter != states[i]->mer_touched.end(); ++iter) {
+                mer_r = *iter;
+                reverse_complement_string(mer_r);
+                const std::string& mer_c = std::min(*iter, mer_r);
+                entries[i].emplace_back(mer_c, *states[i]->mer_counts.try_get(mer_c));
+            }
+            *states[i] = KmerCountState();
+        });
+    }
+    for (auto iter = workers.begin(); iter != workers.end(); ++iter) {
+        iter->join();
     }
+    this->write_aggregate_table(entries, [this](std::string& out, const std::string& mer, const std::uint64_t& count) {
+        std::string mer_r(mer);
+        reverse_complement_string(mer_r);
+        for (int i = 0; i < ((this->write_reverse_complement && (mer != mer_r)) ? 2 : 1); ++i) {
+            out.append(i ? mer_r : mer);
+            out.push_back('\t');
+            append_uint(out, count);
+            out.push_back('\n');
+        }
+    });
+}
 
-    // write the hits
-    kv_pairs.clear();
-    for (auto iter = mer_keys.begin(); iter != mer_keys.end(); ++iter) {
-        std::string mer_key = *iter;
-        auto mer_key_lookup = this->mer_counts().find(mer_key);
-        int mer_key_count = (mer_key_lookup == this->mer_counts().end()) ? 0 : mer_key_lookup->second;
-        if (mer_key_count != 0) {
-            if (this->map_keys)
-                std::sprintf(kv_pair, "%d:%d ", this->mer_key(mer_key), mer_key_count);
-            else
-                std::sprintf(kv_pair, "%s:%d ", mer_key.c_str(), mer_key_count);
-            set_mer_count(mer_key, 0);
-            kv_pairs.append(kv_pair);
+void
+kmer_counter::KmerCounter::format_kmer_count(KmerCountState& state, std::string& out)
+{
+    const int k = this->k();
+    const size_t out_start = out.length();
+    std::string mer_o;
+    std::string mer_r;
+
+    // one pass over the k-mers of this record, each listed once in the orientation it was first seen
+    auto append_mer = [&](const int& c, const std::uint64_t& count) {
+        // c compares the observed k-mer against its reverse complement
+        const std::string& mer = ((c > 0) && this->write_canonical) ? mer_r : mer_o;
+        const std::string& other = ((c > 0) && this->write_canonical) ? mer_o : mer_r;
+        this->append_kmer_count(out, mer, count);
+        if (this->write_reverse_complement && (c != 0)) {
+            this->append_kmer_count(out, other, count);
+        }
+    };
+    if (k <= KmerCounter::max_packed_k) {
+        // mer-keys come straight from the packed code
+        this->for_each_kmer_code(state, [&](const std::uint64_t& code, const std::uint64_t& count) {
+            if (this->map_keys) {
+                append_int(out, this->mer_key(code));
+            }
+            else {
+                decode_mer_code(code, k, mer_o);
+                out.append(mer_o);
+            }
+            out.push_back(':');
+            append_uint(out, count);
+            out.push_back(' ');
+        });
+    }
+    else {
+        for (auto iter = state.mer_touched.begin(); iter != state.mer_touched.end(); ++iter) {
+            mer_o = *iter;
+            mer_r = mer_o;
+            reverse_complement_string(mer_r);
+            int c = mer_o.compare(mer_r);
+            append_mer(c, *state.mer_counts.try_get((c <= 0) ? mer_o : mer_r));
         }
     }
-    if (kv_pairs.length() > 0) {
-        kv_pairs.pop_back();
+    if (out.length() > out_start) {
+        out.pop_back();
     }
+}
 
-    std::fprintf(os, "%s\t%s\t%s\t%s\n", chr, start, stop, kv_pairs.c_str());    
+void
+kmer_counter::KmerCounter::append_kmer_count(std::string& out, const std::string& mer, const std::uint64_t& count)
+{
+    // k-mers too long to pack have no mer-keys
+    out.append(mer);
+    out.push_back(':');
+    append_uint(out, count);
+    out.push_back(' ');
 }
 
 std::string
 kmer_counter::KmerCounter::client_kmer_counter_opt_string(void)
 {
-    static std::string _s("k:o:r:bfcndhv?");
+    static std::string _s("k:o:r:g:O:m:e:t:Q:bfqcndahv?");
     return _s;
 }
 
@@ -386,11 +1022,19 @@ kmer_counter::KmerCounter::client_kmer_counter_long_options(void)
     static struct option _k = { "k",                                 required_argument,   NULL,    'k' };
     static struct option _o = { "offset",                            required_argument,   NULL,    'o' };
     static struct option _r = { "results-dir",                       required_argument,   NULL,    'r' };
+    static struct option _g = { "reference",                         required_argument,   NULL,    'g' };
+    static struct option _O = { "output-format",                     required_argument,   NULL,    'O' };
+    static struct option _m = { "dense-max",                         required_argument,   NULL,    'm' };
+    static struct option _e = { "expected-kmers",                    required_argument,   NULL,    'e' };
+    static struct option _t = { "threads",                           required_argument,   NULL,    't' };
+    static struct option _Q = { "min-qual",                          required_argument,   NULL,    'Q' };
     static struct option _b = { "bed",                               no_argument,         NULL,    'b' };
     static struct option _f = { "fasta",                             no_argument,         NULL,    'f' };
+    static struct option _q = { "fastq",                             no_argument,         NULL,    'q' };
     static struct option _c = { "rc",                                no_argument,         NULL,    'c' };
     static struct option _n = { "non-canonical",                     no_argument,         NULL,    'n' };
     static struct option _d = { "double-count-palindromes",          no_argument,         NULL,    'd' };
+    static struct option _a = { "aggregate",                         no_argument,         NULL,    'a' };
     static struct option _h = { "help",                              no_argument,         NULL,    'h' };
     static struct option _v = { "version",                           no_argument,         NULL,    'v' };
     static struct option _0 = { NULL,                                no_argument,         NULL,     0  };
@@ -398,11 +1042,19 @@ kmer_counter::KmerCounter::client_kmer_counter_long_options(void)
     _s.push_back(_k);
     _s.push_back(_o);
     _s.push_back(_r);
+    _s.push_back(_g);
+    _s.push_back(_O);
+    _s.push_back(_m);
+    _s.push_back(_e);
+    _s.push_back(_t);
+    _s.push_back(_Q);
     _s.push_back(_b);
     _s.push_back(_f);
+    _s.push_back(_q);
     _s.push_back(_c);
     _s.push_back(_n);
     _s.push_back(_d);
+    _s.push_back(_a);
     _s.push_back(_h);
     _s.push_back(_v);
     _s.push_back(_0);
@@ -420,6 +1072,10 @@ kmer_counter::KmerCounter::initialize_command_line_options(int argc, char** argv
                                  &client_long_index);
     int _k = -1;
     int _offset = -1;
+    std::uint64_t _dense_max = 0;
+    std::uint64_t _expected_kmers = 0;
+    int _threads = 1;
+    int _min_qual = 0;
 
     // defaults
     this->input_type = KmerCounter::undefinedInput;
@@ -427,6 +1083,8 @@ kmer_counter::KmerCounter::initialize_command_line_options(int argc, char** argv
     this->write_reverse_complement = false;
     this->double_count_palindromes = false;
     this->write_canonical = true;
+    this->aggregate = false;
+    this->output_format = KmerCounter::textOutput;
 
     opterr = 0; /* disable error reporting by GNU getopt */
     
@@ -443,12 +1101,50 @@ kmer_counter::KmerCounter::initialize_command_line_options(int argc, char** argv
         case 'r':
             this->results_dir(optarg);
             break;
+        case 'g':
+            this->reference_fn(optarg);
+            break;
+        case 'O':
+            if (std::string(optarg) == "text") {
+                this->output_format = KmerCounter::textOutput;
+            }
+            else if (std::string(optarg) == "csr") {
+                this->output_format = KmerCounter::csrOutput;
+            }
+            else if (std::string(optarg) == "npy") {
+                this->output_format = KmerCounter::npyOutput;
+            }
+            else {
+                std::fprintf(stderr, "Error: Unknown output format [%s]\n", optarg);
+                this->print_usage(stderr);
+                std::exit(EINVAL);
+            }
+            break;
+        case 'm':
+            std::sscanf(optarg, "%" SCNu64, &_dense_max);
+            this->dense_max(_dense_max);
+            break;
+        case 'e':
+            std::sscanf(optarg, "%" SCNu64, &_expected_kmers);
+            this->expected_kmers(_expected_kmers);
+            break;
+        case 't':
+            std::sscanf(optarg, "%d", &_threads);
+            this->threads(_threads);
+            break;
+        case 'Q':
+            std::sscanf(optarg, "%d", &_min_qual);
+            this->min_qual(_min_qual);
+            break;
         case 'b':
             this->input_type = KmerCounter::bedInput;
             break;
         case 'f':
             this->input_type = KmerCounter::fastaInput;
             break;
+        case 'q':
+            this->input_type = KmerCounter::fastqInput;
+            break;
         case 'c':
             this->write_reverse_complement = true;
             break;
@@ -458,6 +1154,9 @@ kmer_counter::KmerCounter::initialize_command_line_options(int argc, char** argv
         case 'd':
             this->double_count_palindromes = true;
             break;
+        case 'a':
+            this->aggregate = true;
+            break;
         case 'h':
             this->print_usage(stdout);
             std::exit(EXIT_SUCCESS);
@@ -490,35 +1189,141 @@ kmer_counter::KmerCounter::initialize_command_line_options(int argc, char** argv
         while (++optind < argc);
     }
 
+    // no input file given: read stdin
+    if (this->input_fn().empty()) {
+        this->initialize_in_stream();
+    }
+
     if (this->k() == -1) {
         std::fprintf(stderr, "Error: Specify k value\n");
         this->print_usage(stderr);
         std::exit(ENODATA);
     }
 
+    if (this->k() < 1) {
+        std::fprintf(stderr, "Error: Specify a positive k value\n");
+        this->print_usage(stderr);
+        std::exit(EINVAL);
+    }
+
+    if (this->k() <= KmerCounter::max_packed_k) {
+        // dispatch once to the packed counting kernel compiled for this k
+        _count_mer_codes = KmerCounter::count_mer_codes_kernel(this->k(), std::make_integer_sequence<int, KmerCounter::max_packed_k>());
+    }
+
+    this->initialize_count_state(_count_state);
+
+    if (this->threads() < 1) {
+        std::fprintf(stderr, "Error: Specify a positive number of threads\n");
+        this->print_usage(stderr);
+        std::exit(EINVAL);
+    }
+
+    if ((this->min_qual() < 0) || (this->min_qual() > 93)) {
+        std::fprintf(stderr, "Error: Specify a minimum quality between 0 and 93\n");
+        this->print_usage(stderr);
+        std::exit(EINVAL);
+    }
+
     this->map_keys = true;
     if (this->offset() == -1) {
         this->map_keys = false;
     }
 
+    if (this->map_keys && (this->k() > KmerCounter::max_mer_key_k)) {
+        std::fprintf(stderr, "Error: Mer-keys need k <= %d\n", KmerCounter::max_mer_key_k);
+        this->print_usage(stderr);
+        std::exit(EINVAL);
+    }
+
     if (this->input_type == KmerCounter::undefinedInput) {
-        std::fprintf(stderr, "Error: Specify input type value (BED or FASTA)\n");
+        std::fprintf(stderr, "Error: Specify input type value (BED, FASTA or FASTQ)\n");
         this->print_usage(stderr);
         std::exit(ENODATA);
     }
 
+    if (!this->reference_fn().empty() && (this->input_type != KmerCounter::bedInput)) {
+        std::fprintf(stderr, "Error: A reference genome can only be used with BED input\n");
+        this->print_usage(stderr);
+        std::exit(EINVAL);
+    }
+
+    if (this->aggregate) {
+        if (this->results_dir().empty()) {
+            std::fprintf(stderr, "Error: Aggregate counts need a results directory\n");
+            this->print_usage(stderr);
+            std::exit(EINVAL);
+        }
+        if ((this->output_format != KmerCounter::textOutput) || !this->write_canonical) {
+            std::fprintf(stderr, "Error: Aggregate counts are a text table of canonical k-mers\n");
+            this->print_usage(stderr);
+            std::exit(EINVAL);
+        }
+    }
+
+    if (this->aggregate && (this->threads() > 1) && (this->k() <= KmerCounter::max_packed_k) && !_count_state.mer_code_counts.dense() && (this->expected_kmers() > 0)) {
+        // threads count into one shared table, sized up front from the caller's estimate
+        const std::uint64_t expected = std::min(this->expected_kmers(), KmerCounter::mer_code_mask(this->k()));
+        if ((expected > SIZE_MAX) || !this->shared_counts.try_reserve((size_t) expected)) {
+            std::fprintf(stderr, "Error: Could not allocate a shared k-mer table for %" PRIu64 " distinct k-mers; set --expected-kmers lower\n", expected);
+            std::exit(ENOMEM);
+        }
+    }
+
+    if (this->output_format == KmerCounter::npyOutput) {
+        if (this->results_dir().empty()) {
+            std::fprintf(stderr, "Error: Dense matrix output needs a results directory\n");
+            this->print_usage(stderr);
+            std::exit(EINVAL);
+        }
+        if (this->k() > KmerCounter::max_npy_k) {
+            std::fprintf(stderr, "Error: Dense matrix output needs k <= %d\n", KmerCounter::max_npy_k);
+            this->print_usage(stderr);
+            std::exit(EINVAL);
+        }
+    }
+
+    if (this->output_format == KmerCounter::csrOutput) {
+        if (this->results_dir().empty()) {
+            std::fprintf(stderr, "Error: Sparse matrix output needs a results directory\n");
+            this->print_usage(stderr);
+            std::exit(EINVAL);
+        }
+        if (this->k() > KmerCounter::max_packed_k) {
+            std::fprintf(stderr, "Error: Sparse matrix output needs k <= %d\n", KmerCounter::max_packed_k);
+            this->print_usage(stderr);
+            std::exit(EINVAL);
+        }
+    }
+
     if (this->results_dir().empty()) {
         this->write_results_to_stdout = true;    
     }
     else {
         this->results_dir_mode(0755);
         if (this->initialize_result_dir(this->results_dir(), this->results_dir_mode())) {
-            switch (this->input_type) {
+            if (this->output_format == KmerCounter::csrOutput) {
+                this->initialize_kmer_count_stream("count.csr");
+                this->csr_writer.open(this->results_kmer_count_stream(), this->k(), this->offset(),
+                                      (this->write_canonical ? CsrWriter::canonical_flag : 0) |
+                                      (this->write_reverse_complement ? CsrWriter::reverse_complement_flag : 0) |
+                                      (this->map_keys ? CsrWriter::mer_key_flag : 0));
+                _count_state.csr_writer = &this->csr_writer;
+            }
+            else if (this->output_format == KmerCounter::npyOutput) {
+                this->initialize_kmer_count_stream("count.npy");
+                this->npy_writer.open(this->results_kmer_count_stream(), this->k());
+            }
+            else if (this->aggregate) {
+                this->initialize_kmer_count_stream("count.txt");
+            }
+            else switch (this->input_type) {
                 case kmer_counter::KmerCounter::bedInput:
                     if (!this->write_results_to_stdout)
                         this->initialize_kmer_count_stream("count.bed");
                     break;
                 case kmer_counter::KmerCounter::fastaInput:
+                case kmer_counter::KmerCounter::fastqInput:
                     if (!this->write_results_to_stdout)
                         this->initialize_kmer_count_stream("count.txt");
                     break;
@@ -571,10 +1376,11 @@ kmer_counter::KmerCounter::client_kmer_counter_usage(void)
 std::string
 kmer_counter::KmerCounter::client_kmer_counter_description(void)
 {
-    static std::string _s("  Count kmers in BED or FASTA file and report counts\n" \
+    static std::string _s("  Count kmers in BED, FASTA or FASTQ file and report counts\n" \
                           "  for each element, from specified offset. Write a key-\n" \
                           "  count file and key table as output for BED input, or\n" \
-                          "  write a header and mer-count table as output for FASTA.\n");
+                          "  write a header and mer-count table as output for FASTA\n" \
+                          "  and FASTQ.\n");
     return _s;
 }
 
@@ -583,11 +1389,19 @@ kmer_counter::KmerCounter::client_kmer_counter_io_options(void)
 {
     static std::string _s("  General Options:\n\n"              \
                           "  --k=n                       K-value for kmer length (integer, required)\n" \
-                          " [--bed | --fasta]            BED or FASTA input (required)\n" \
+                          " [--bed | --fasta | --fastq]  BED, FASTA or FASTQ input (required)\n" \
+                          "  --min-qual=n                Skip FASTQ k-mers with any base below this Phred quality (integer, default 0)\n" \
                           "  --rc                        Enable writing of non-palindrome reverse complement counts (optional)\n" \
+                          "  --non-canonical             Write k-mers as first seen, instead of canonical form (optional)\n" \
                           "  --double-count-palindromes  Double-count palindromes (optional)\n" \
+                          "  --aggregate                 Write one table of k-mer counts over the whole input, and histogram.txt of their abundances (optional)\n" \
                           "  --offset=n                  Offset for BED-based mer-map kv pairing (integer)\n" \
-                          "  --results-dir=s             Results directory (string)\n");
+                          "  --dense-max=n               Largest 4^k counted in a flat array instead of a hash table (integer, default 16777216)\n" \
+                          "  --results-dir=s             Results directory (string)\n" \
+                          "  --output-format=s           Write counts as text, as a binary sparse matrix in count.csr with csr, or as a dense NumPy matrix in count.npy with npy (k <= 8) (string, default text)\n" \
+                          "  --reference=s               Read BED3 interval sequences from an indexed FASTA (.fai) or .2bit genome (string)\n" \
+                          "  --expected-kmers=n          Distinct k-mers expected with --aggregate on several threads, to size one shared table (integer, default none: each thread keeps its own table)\n" \
+                          "  --threads=n                 Count FASTA records, or byte ranges of a BED file, on n threads (integer, default 1)\n");
     return _s;
 }
 
@@ -26,15 +26,404 @@ extern "C" {
 #include <climits>
 #include <cinttypes>
 #include <cstring>
+#include <map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <utility>
 #include <getopt.h>
 #include <pthread.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "hash_map.hpp"
 
-#define KMER_COUNTER_LINE_MAX 268435456
+#define KMER_COUNTER_READ_BLOCK 1048576
+#define KMER_COUNTER_PREFETCH_LEN 4194304
+#define KMER_COUNTER_WRITE_BLOCK 4194304
+#define KMER_COUNTER_DENSE_MAX 16777216
+#define KMER_COUNTER_CHUNK_MIN_LEN 4194304
+#define KMER_COUNTER_PARTIAL_MEMORY 1073741824
 
 namespace kmer_counter
 {
+    typedef emilib::ConcurrentCountMap<std::uint64_t, std::uint64_t> SharedKmerCounts;
+
+    /*
+     * Per-record counts keyed by canonical packed k-mer code. When all 4^k
+     * codes fit under the dense limit, counts live in a flat array indexed
+     * directly by code; otherwise they live in a hash table. Each k-mer is
+     * listed in the orientation it was first observed in, in the order it
+     * was first touched, so that visiting and resetting a record costs
+     * O(distinct k-mers in record), not O(table size). A table may instead
+     * pass every increment on to a concurrent table shared by all threads,
+     * in which case it keeps nothing itself.
+     */
+    class KmerCountTable
+    {
+
+    private:
+        int _k = 0;
+        bool _dense = false;
+        std::vector<std::uint64_t> _dense_counts;
+        emilib::GroupHashMap<std::uint64_t, std::uint64_t> _sparse_counts;
+        std::vector<std::uint64_t> _touched;
+        SharedKmerCounts* _shared = NULL;
+
+    public:
+        void initialize(const int& k, const std::uint64_t& dense_max);
+        void share(SharedKmerCounts* shared);
+        bool dense(void) const;
+        size_t size(void) const;
+        void increment(const std::uint64_t& c, const std::uint64_t& observed, const std::uint64_t& n);
+        void increment_batch(const std::uint64_t* c, const std::uint64_t* observed, const std::uint64_t* n, size_t count);
+        std::uint64_t count(const std::uint64_t& c) const;
+        void merge(const KmerCountTable& other);
+        void clear(void);
+
+        template <typename FnT>
+        void for_each(FnT fn) const;
+    };
+
+    /*
+     * Rows of a sparse count matrix waiting to be written: little-endian
+     * 64-bit keys and 32-bit counts, and the number of non-zeros per row.
+     */
+    struct CsrBlock
+    {
+        std::string keys;
+        std::string counts;
+        std::vector<std::uint64_t> row_nnz;
+    };
+
+    class CsrWriter;
+
+    /*
+     * Everything one stream of records needs to count and write k-mers:
+     * packed counts for k <= 32, string counts for larger k, the reusable
+     * encode buffers, the rolling window carried between pieces of one
+     * sequence, and formatted output waiting to be written in one large
+     * block. Each worker thread owns its own.
+     */
+    struct KmerCountState
+    {
+        KmerCountTable mer_code_counts;
+        emilib::GroupHashMap<std::string, std::uint64_t> mer_counts;
+        std::vector<std::string> mer_touched;
+        std::vector<unsigned char> sequence_codes;
+        std::vector<std::uint64_t> ambiguous_bases;
+        std::uint64_t mer_f = 0;
+        std::uint64_t mer_r = 0;
+        int valid_len = 0;
+        std::string mer_carry;
+        std::string output;
+        CsrBlock csr;
+        CsrWriter* csr_writer = NULL;
+        std::vector<std::uint32_t> dense_row;
+        std::uint64_t row = 0;
+
+        void increment_mer_count(const std::string& k, const std::string& observed, const std::uint64_t& n);
+        void increment_mer_count(const char* k, const char* observed, const size_t& len, const std::uint64_t& n);
+    };
+
+    /*
+     * Binary sparse (CSR) count matrix, one row per record, in input order.
+     * All values are little-endian. The file holds a 64-byte header, then
+     * the arrays at the offsets it gives, each starting 8-byte aligned:
+     *
+     *   0  char[8]   "KMERCSR1"
+     *   8  uint32    k
+     *  12  int32     mer-key offset, or -1 when keys are packed 2-bit codes
+     *  16  uint32    flags: 1 canonical, 2 reverse complements, 4 mer-keys
+     *  20  uint32    reserved
+     *  24  uint64    rows
+     *  32  uint64    non-zeros
+     *  40  uint64    offset of uint64 keys[non-zeros]
+     *  48  uint64    offset of uint32 counts[non-zeros]
+     *  56  uint64    offset of uint64 row pointers[rows + 1]
+     *
+     * Keys go straight to the output file. Counts are spooled to a
+     * temporary file and appended on finish, before the row pointers and
+     * the final header. A fragment spools both arrays, so that shards can be
+     * appended to the main writer in order.
+     */
+    class CsrWriter
+    {
+
+    private:
+        FILE* _os = NULL;
+        FILE* _keys = NULL;
+        FILE* _counts = NULL;
+        std::vector<std::uint64_t> _row_nnz;
+        std::uint64_t _nnz = 0;
+        std::uint32_t _k = 0;
+        std::int32_t _offset = -1;
+        std::uint32_t _flags = 0;
+
+        static void put_u32(std::string& out, std::uint32_t v);
+        static void put_u64(std::string& out, std::uint64_t v);
+        static void copy_stream(FILE* is, FILE* os);
+        static FILE* spool(void);
+
+    public:
+        static const std::uint32_t canonical_flag = 1;
+        static const std::uint32_t reverse_complement_flag = 2;
+        static const std::uint32_t mer_key_flag = 4;
+
+        void open(FILE* os, int k, int offset, std::uint32_t flags);
+        void open_fragment(void);
+        void append(CsrBlock& block);
+        void append(CsrWriter& fragment);
+        void finish(void);
+        static void append_entry(CsrBlock& block, std::uint64_t key, std::uint64_t count);
+    };
+
+    /*
+     * Dense row-major count matrix in NumPy .npy format (version 1.0), of
+     * uint32 counts in host byte order, one row per record and one column
+     * per map.txt mer-key. Every row has the same size, so rows are written
+     * with pwrite() at fixed offsets, from any thread and in any order. The
+     * header is padded to 128 bytes and rewritten with the row count on
+     * finish.
+     */
+    class NpyWriter
+    {
+
+    private:
+        int _fd = -1;
+        std::uint64_t _columns = 0;
+        std::atomic<std::uint64_t> _rows{0};
+
+        void write_at(const void* buf, size_t len, std::uint64_t offset);
+        void write_header(void);
+
+    public:
+        static const size_t header_len = 128;
+
+        void open(FILE* os, int k);
+        void write_row(std::uint64_t row, const std::uint32_t* counts);
+        void finish(void);
+    };
+
+    /*
+     * Bounded queue between a reader, a pool of workers and a writer. The
+     * reader pushes batches, workers take and finish them in any order, and
+     * the writer receives finished batches strictly in the order they were
+     * pushed. At most max_in_flight batches exist between push and write.
+     */
+    template <typename BatchT>
+    class OrderedBatchQueue
+    {
+
+    private:
+        std::mutex _mutex;
+        std::condition_variable _work_cv;
+        std::condition_variable _done_cv;
+        std::condition_variable _space_cv;
+        std::deque<std::unique_ptr<BatchT>> _work;
+        std::map<size_t, std::unique_ptr<BatchT>> _done;
+        size_t _next_push = 0;
+        size_t _next_write = 0;
+        size_t _max_in_flight;
+        bool _closed = false;
+
+    public:
+        explicit OrderedBatchQueue(size_t max_in_flight) : _max_in_flight(max_in_flight) {}
+
+        void push(std::unique_ptr<BatchT> batch) {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _space_cv.wait(lock, [this] { return _next_push - _next_write < _max_in_flight; });
+            batch->index = _next_push++;
+            _work.push_back(std::move(batch));
+            _work_cv.notify_one();
+        }
+
+        std::unique_ptr<BatchT> take(void) {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _work_cv.wait(lock, [this] { return !_work.empty() || _closed; });
+            if (_work.empty()) {
+                return nullptr;
+            }
+            std::unique_ptr<BatchT> batch = std::move(_work.front());
+            _work.pop_front();
+            return batch;
+        }
+
+        void finish(std::unique_ptr<BatchT> batch) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _done[batch->index] = std::move(batch);
+            _done_cv.notify_all();
+        }
+
+        std::unique_ptr<BatchT> next_finished(void) {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _done_cv.wait(lock, [this] { return (_done.count(_next_write) > 0) || (_closed && (_next_write == _next_push)); });
+            auto found = _done.find(_next_write);
+            if (found == _done.end()) {
+                return nullptr;
+            }
+            std::unique_ptr<BatchT> batch = std::move(found->second);
+            _done.erase(found);
+            _next_write++;
+            _space_cv.notify_one();
+            return batch;
+        }
+
+        void close(void) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _closed = true;
+            _work_cv.notify_all();
+            _done_cv.notify_all();
+        }
+    };
+
+    /*
+     * Decompressed bytes of a gzip input, produced on background threads. A
+     * reader thread cuts the compressed input into batches. BGZF input is cut
+     * on block boundaries, so a pool of workers can inflate batches in
+     * parallel. Plain gzip goes to a single worker, which keeps its inflate
+     * stream across batches, so reading, inflating and counting overlap.
+     * Inflated batches are read back strictly in input order.
+     */
+    class GzipInput
+    {
+
+    private:
+        struct Block {
+            size_t index;
+            std::string compressed;
+            std::string data;
+        };
+
+        const char* _src = NULL;
+        size_t _src_len = 0;
+        size_t _src_pos = 0;
+        FILE* _fp = NULL;
+        std::string _pending;
+        bool _bgzf = false;
+        std::unique_ptr<OrderedBatchQueue<Block>> _queue;
+        std::vector<std::thread> _threads;
+        std::unique_ptr<Block> _block;
+        size_t _block_pos = 0;
+
+        size_t read_compressed(char* buf, size_t len);
+        bool read_bgzf_block(std::string& compressed);
+        static bool inflate_members(z_stream& z, bool& member_end, const std::string& in, std::string& out);
+
+    public:
+        ~GzipInput();
+        static bool is_gzip(const char* data, size_t len);
+        static bool is_bgzf(const char* data, size_t len);
+        void open(const char* data, size_t len, FILE* fp, int threads);
+        size_t read(char* buf, size_t len);
+        void close(void);
+    };
+
+    /*
+     * Line reader over the input. A regular file is mapped read-only and
+     * lines are (pointer, length) views into the mapping that stay valid
+     * until close. Stdin, pipes and anything else that cannot be mapped is
+     * read in blocks into an owned buffer, and each view is only valid until
+     * the next call. Views never include the line terminator. Lines longer
+     * than the buffer can also be taken in parts, so memory stays bounded.
+     * Gzip and BGZF input is detected by its magic bytes and always streamed,
+     * inflated on background threads.
+     */
+    class InputReader
+    {
+
+    private:
+        FILE* _fp = NULL;
+        void* _map = NULL;
+        size_t _map_len = 0;
+        const char* _data = NULL;
+        size_t _len = 0;
+        size_t _pos = 0;
+        bool _mapped = false;
+        bool _eof = false;
+        std::vector<char> _buffer;
+        std::unique_ptr<GzipInput> _gzip;
+
+    public:
+        ~InputReader();
+        void open(FILE* fp, int threads);
+        void open(const char* data, size_t len);
+        void close(void);
+        bool mapped(void) const;
+        bool stable(const char* p) const;
+        const char* data(void) const;
+        size_t size(void) const;
+        bool next_line(const char*& line, size_t& line_len);
+        bool next_line_part(const char*& part, size_t& part_len, bool& line_end);
+
+    private:
+        bool read_line(const char*& line, size_t& line_len, bool& line_end, bool grow);
+        size_t read_block(char* buf, size_t len);
+    };
+
+    /*
+     * Per-caller scratch for reference lookups. It holds the buffer that
+     * 2bit bases are unpacked into and how far ahead the mapping has been
+     * prefetched. Each worker thread owns its own.
+     */
+    struct ReferenceCursor
+    {
+        std::string scratch;
+        const char* prefetch_start = NULL;
+        const char* prefetch_end = NULL;
+    };
+
+    /*
+     * Read-only, memory-mapped reference genome for resolving BED3 intervals.
+     * It is either a FASTA file with a samtools-style .fai index next to it,
+     * or a UCSC .2bit file. FASTA intervals are handed on a line at a time as
+     * views into the mapping. 2bit intervals are unpacked, with N blocks
+     * applied, into the cursor's scratch buffer.
+     */
+    class ReferenceGenome
+    {
+
+    private:
+        struct Sequence {
+            std::uint64_t length = 0;
+            std::uint64_t offset = 0;
+            std::uint64_t line_bases = 0;
+            std::uint64_t line_width = 0;
+            std::vector<std::uint32_t> n_starts;
+            std::vector<std::uint32_t> n_sizes;
+        };
+
+        void* _map = NULL;
+        size_t _map_len = 0;
+        const unsigned char* _data = NULL;
+        bool _two_bit = false;
+        bool _swapped = false;
+        std::vector<Sequence> _sequences;
+        emilib::HashMap<std::string, size_t> _names;
+
+        std::uint32_t read_u32(size_t offset) const;
+        void load_fai(const std::string& fn);
+        void load_two_bit(void);
+        void prefetch(ReferenceCursor& cursor, const unsigned char* start, const unsigned char* end) const;
+
+    public:
+        ~ReferenceGenome();
+        void open(const std::string& fn);
+        bool loaded(void) const;
+        void fetch(ReferenceCursor& cursor, const char* name, size_t name_len, std::uint64_t start, std::uint64_t stop,
+                   const std::function<void(const char*, size_t)>& on_piece) const;
+    };
+
     class KmerCounter
     {
         
@@ -43,30 +432,76 @@ namespace kmer_counter
         int _offset;
         std::string _input_fn;
         FILE* _in_stream;
+        InputReader _input;
+        std::string _reference_fn;
+        ReferenceGenome _reference;
         std::string _results_dir;
         std::string _results_kmer_count_fn;
         FILE* _results_kmer_count_stream = NULL;
         std::string _results_kmer_map_fn;
         FILE* _results_kmer_map_stream = NULL;
         mode_t _results_dir_mode;
-        emilib::HashMap<std::string, int> _mer_keys;
-        emilib::HashMap<std::string, int> _mer_counts;        
+        std::uint64_t _dense_max;
+        std::uint64_t _expected_kmers;
+        int _threads;
+        int _min_qual;
+        KmerCountState _count_state;
+        typedef void (KmerCounter::*CountMerCodesFn)(KmerCountState&, const char*, size_t, const char*);
+        CountMerCodesFn _count_mer_codes = NULL;
         
     public:
         enum KmerCounterInput {
             undefinedInput = 0,
             bedInput,
-            fastaInput
+            fastaInput,
+            fastqInput
+        };
+
+        enum KmerCounterOutput {
+            textOutput = 0,
+            csrOutput,
+            npyOutput
         };
 
         void parse_bed_input_to_counts(void);
+        void parse_bed_input_to_counts_parallel(void);
+        void parse_bed_range(InputReader& reader, KmerCountState& state, FILE* os);
         void parse_fasta_input_to_counts(void);
-        void process_fasta_record(char* header, char* sequence);
+        void parse_fastq_input_to_counts(void);
+        void parse_records_to_counts_parallel(void);
+        void read_fasta_records(const std::function<void(const char*, size_t, const char*, size_t)>& on_record);
+        void stream_fasta_records(const std::function<void(const char*, size_t)>& on_header,
+                                  const std::function<void(const char*, size_t)>& on_sequence,
+                                  const std::function<void(void)>& on_record_end);
+        void read_fastq_records(const std::function<void(const char*, size_t, const char*, size_t, const char*)>& on_record);
+        void initialize_count_state(KmerCountState& state);
+        void count_mers(KmerCountState& state, const char* sequence, size_t sequence_len, const char* quality = NULL);
+        void begin_mers(KmerCountState& state);
+        void feed_mers(KmerCountState& state, const char* sequence, size_t sequence_len, const char* quality = NULL);
+        void count_mers_parallel(KmerCountState& state, const char* sequence, size_t sequence_len, const char* quality = NULL);
+        void merge_count_state(KmerCountState& state, const KmerCountState& partial);
+        template <int K>
+        void count_mer_codes(KmerCountState& state, const char* sequence, size_t sequence_len, const char* quality);
+        template <int... Ks>
+        static CountMerCodesFn count_mer_codes_kernel(const int& k, std::integer_sequence<int, Ks...>);
+        void count_mer_strings(KmerCountState& state, const char* sequence, size_t sequence_len, const char* quality);
+        void format_kmer_count(KmerCountState& state, std::string& out);
+        void append_kmer_count(std::string& out, const std::string& mer, const std::uint64_t& count);
+        void flush_kmer_count(FILE* os, KmerCountState& state);
+        void append_csr_row(KmerCountState& state);
+        void append_npy_row(KmerCountState& state);
+        template <typename FnT>
+        void for_each_kmer_code(KmerCountState& state, FnT fn);
+        template <typename FnT>
+        void for_each_kmer_key(KmerCountState& state, FnT fn);
+        void write_aggregate_counts(std::vector<KmerCountState*>& states);
+        template <typename KeyT, typename FnT>
+        void write_aggregate_table(std::vector<std::vector<std::pair<KeyT, std::uint64_t>>>& entries, FnT format);
+        void reset_record_counts(KmerCountState& state);
         void initialize_command_line_options(int argc, char** argv);
-        void initialize_kmer_map(void);
         void print_kmer_map(FILE* wo_stream);
-        void print_kmer_count(FILE* os, char header[]);
-        void print_kmer_count(FILE* wo_stream, char chr[], char start[], char stop[]);
+        void print_kmer_count(FILE* os, const char* header, size_t header_len);
+        void print_kmer_count(FILE* wo_stream, KmerCountState& state, const char* chr, size_t chr_len, const char* start, size_t start_len, const char* stop, size_t stop_len);
         void close_output_streams(void);
 
         static const std::string client_name;
@@ -78,6 +513,11 @@ namespace kmer_counter
         bool write_reverse_complement;
         bool double_count_palindromes;
         bool write_canonical;
+        bool aggregate;
+        KmerCounterOutput output_format;
+        CsrWriter csr_writer;
+        NpyWriter npy_writer;
+        SharedKmerCounts shared_counts;
 
         std::string client_kmer_counter_opt_string(void);
         struct option* client_kmer_counter_long_options(void);
@@ -111,27 +551,217 @@ namespace kmer_counter
         void in_stream(FILE** ri_stream_ptr);
         void initialize_in_stream(void);
         void close_in_stream(void);
+        InputReader& input(void);
+        const std::string& reference_fn(void);
+        void reference_fn(const std::string& s);
+        const ReferenceGenome& reference(void);
         const std::string& input_fn(void);
         void input_fn(const std::string& s);
         const int& k(void);
         void k(const int& k);
         const int& offset(void);
-        int offset(const bool& increment);
         void offset(const int& o);
-        void increment_offset(void);
-        const emilib::HashMap<std::string, int>& mer_counts(void);
-        void mer_counts(const emilib::HashMap<std::string, int>& mc);
-        auto mer_count(const std::string& k);
-        void erase_mer_count(const std::string& k);
-        void set_mer_count(const std::string& k, const int& v);
-        void increment_mer_count(const std::string& k);        
-        const emilib::HashMap<std::string, int>& mer_keys(void);
-        void mer_keys(const emilib::HashMap<std::string, int>& mk);
-        void set_mer_key(const std::string& k, const int& v);
-        auto mer_key(const std::string& k);
-        
-        static void reverse_complement_string(std::string &s) {
-            static unsigned char base_complement_map[256] = {
+        std::int64_t mer_key(const std::uint64_t& code);
+        const std::uint64_t& dense_max(void);
+        void dense_max(const std::uint64_t& m);
+        const std::uint64_t& expected_kmers(void);
+        void expected_kmers(const std::uint64_t& n);
+        const int& threads(void);
+        void threads(const int& t);
+        const int& min_qual(void);
+        void min_qual(const int& q);
+
+        static const int max_packed_k = 32;
+        static const int max_npy_k = 8;
+        static const int max_mer_key_k = 31;
+
+        static const unsigned char* base_code_map(void) {
+            /* A, C, G and T (either case) to 2-bit codes; anything else is ambiguous (4) */
+            static const unsigned char _base_code_map[256] = {
+                4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+                4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+                4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+                4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+                4, 0, 4, 1, 4, 4, 4, 2, 4, 4, 4, 4, 4, 4, 4, 4,
+                4, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+                4, 0, 4, 1, 4, 4, 4, 2, 4, 4, 4, 4, 4, 4, 4, 4,
+                4, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+                4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+                4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+                4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+                4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+                4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+                4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+                4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4,
+                4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4
+            };
+            return _base_code_map;
+        }
+
+        static std::uint64_t mer_code_mask(int k) {
+            return (k >= max_packed_k) ? UINT64_MAX : ((1ULL << (2 * k)) - 1);
+        }
+
+        /*
+         * Uppercase, validate and convert a sequence to 2-bit codes in bulk, with
+         * ambiguous (non-ACGT) bases coded as 4 and flagged in a bitmap of 64-base
+         * words. Uses AVX2 or SSE2 where the build targets them.
+         */
+        static void encode_sequence(const char* s, size_t len, std::vector<unsigned char>& codes, std::vector<std::uint64_t>& ambiguous) {
+            const unsigned char* base_codes = base_code_map();
+            size_t i = 0;
+
+            codes.resize(len);
+            ambiguous.assign((len + 63) / 64, 0);
+#if defined(__AVX2__)
+            {
+                const __m256i case_mask = _mm256_set1_epi8((char) 0xDF);
+                const __m256i a = _mm256_set1_epi8('A');
+                const __m256i c = _mm256_set1_epi8('C');
+                const __m256i g = _mm256_set1_epi8('G');
+                const __m256i t = _mm256_set1_epi8('T');
+                const __m256i one = _mm256_set1_epi8(1);
+                const __m256i two = _mm256_set1_epi8(2);
+                const __m256i three = _mm256_set1_epi8(3);
+                const __m256i four = _mm256_set1_epi8(4);
+                for (; i + 32 <= len; i += 32) {
+                    __m256i v = _mm256_and_si256(_mm256_loadu_si256((const __m256i*) (s + i)), case_mask);
+                    __m256i is_a = _mm256_cmpeq_epi8(v, a);
+                    __m256i is_c = _mm256_cmpeq_epi8(v, c);
+                    __m256i is_g = _mm256_cmpeq_epi8(v, g);
+                    __m256i is_t = _mm256_cmpeq_epi8(v, t);
+                    __m256i valid = _mm256_or_si256(_mm256_or_si256(is_a, is_c), _mm256_or_si256(is_g, is_t));
+                    __m256i code = _mm256_or_si256(_mm256_and_si256(is_c, one), _mm256_or_si256(_mm256_and_si256(is_g, two), _mm256_and_si256(is_t, three)));
+                    code = _mm256_or_si256(code, _mm256_andnot_si256(valid, four));
+                    _mm256_storeu_si256((__m256i*) (codes.data() + i), code);
+                    std::uint64_t invalid = ~((std::uint64_t) (std::uint32_t) _mm256_movemask_epi8(valid)) & 0xFFFFFFFFULL;
+                    ambiguous[i >> 6] |= invalid << (i & 63);
+                }
+            }
+#endif
+#if defined(__SSE2__)
+            {
+                const __m128i case_mask = _mm_set1_epi8((char) 0xDF);
+                const __m128i a = _mm_set1_epi8('A');
+                const __m128i c = _mm_set1_epi8('C');
+                const __m128i g = _mm_set1_epi8('G');
+                const __m128i t = _mm_set1_epi8('T');
+                const __m128i one = _mm_set1_epi8(1);
+                const __m128i two = _mm_set1_epi8(2);
+                const __m128i three = _mm_set1_epi8(3);
+                const __m128i four = _mm_set1_epi8(4);
+                for (; i + 16 <= len; i += 16) {
+                    __m128i v = _mm_and_si128(_mm_loadu_si128((const __m128i*) (s + i)), case_mask);
+                    __m128i is_a = _mm_cmpeq_epi8(v, a);
+                    __m128i is_c = _mm_cmpeq_epi8(v, c);
+                    __m128i is_g = _mm_cmpeq_epi8(v, g);
+                    __m128i is_t = _mm_cmpeq_epi8(v, t);
+                    __m128i valid = _mm_or_si128(_mm_or_si128(is_a, is_c), _mm_or_si128(is_g, is_t));
+                    __m128i code = _mm_or_si128(_mm_and_si128(is_c, one), _mm_or_si128(_mm_and_si128(is_g, two), _mm_and_si128(is_t, three)));
+                    code = _mm_or_si128(code, _mm_andnot_si128(valid, four));
+                    _mm_storeu_si128((__m128i*) (codes.data() + i), code);
+                    std::uint64_t invalid = ~((std::uint64_t) _mm_movemask_epi8(valid)) & 0xFFFFULL;
+                    ambiguous[i >> 6] |= invalid << (i & 63);
+                }
+            }
+#endif
+            for (; i < len; ++i) {
+                codes[i] = base_codes[(unsigned char) s[i]];
+                if (codes[i] > 3) {
+                    ambiguous[i >> 6] |= 1ULL << (i & 63);
+                }
+            }
+        }
+
+        /*
+         * Flag bases whose Phred+33 quality is below min_qual in the same bitmap
+         * that encode_sequence() fills, so no window may include them.
+         */
+        static void mask_low_quality(const char* q, size_t len, int min_qual, std::vector<std::uint64_t>& ambiguous) {
+            const char threshold = (char) (33 + min_qual);
+            size_t i = 0;
+#if defined(__AVX2__)
+            {
+                const __m256i t = _mm256_set1_epi8(threshold);
+                for (; i + 32 <= len; i += 32) {
+                    __m256i low = _mm256_cmpgt_epi8(t, _mm256_loadu_si256((const __m256i*) (q + i)));
+                    ambiguous[i >> 6] |= ((std::uint64_t) (std::uint32_t) _mm256_movemask_epi8(low)) << (i & 63);
+                }
+            }
+#endif
+#if defined(__SSE2__)
+            {
+                const __m128i t = _mm_set1_epi8(threshold);
+                for (; i + 16 <= len; i += 16) {
+                    __m128i low = _mm_cmpgt_epi8(t, _mm_loadu_si128((const __m128i*) (q + i)));
+                    ambiguous[i >> 6] |= ((std::uint64_t) _mm_movemask_epi8(low)) << (i & 63);
+                }
+            }
+#endif
+            for (; i < len; ++i) {
+                if (q[i] < threshold) {
+                    ambiguous[i >> 6] |= 1ULL << (i & 63);
+                }
+            }
+        }
+
+        static std::uint64_t reverse_complement_code(std::uint64_t code, int k) {
+            // complement every base, then reverse the order of the 2-bit groups
+            code = ~code;
+            code = ((code >> 2) & 0x3333333333333333ULL) | ((code & 0x3333333333333333ULL) << 2);
+            code = ((code >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((code & 0x0F0F0F0F0F0F0F0FULL) << 4);
+            code = ((code >> 8) & 0x00FF00FF00FF00FFULL) | ((code & 0x00FF00FF00FF00FFULL) << 8);
+            code = ((code >> 16) & 0x0000FFFF0000FFFFULL) | ((code & 0x0000FFFF0000FFFFULL) << 16);
+            code = (code >> 32) | (code << 32);
+            return code >> (64 - 2 * k);
+        }
+
+        static std::uint64_t mer_map_index(std::uint64_t code, int k) {
+            // map.txt numbers k-mers with the first base in the lowest bits, the 2-bit groups of a packed code reversed
+            return reverse_complement_code(~code, k);
+        }
+
+        static void append_uint(std::string& out, std::uint64_t v) {
+            /* Decimal digits two at a time from a lookup table, written back to front */
+            static const char digit_pairs[] = "00010203040506070809101112131415161718192021222324252627282930313233343536373839404142434445464748495051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+            char buf[20];
+            char* p = buf + sizeof(buf);
+            while (v >= 100) {
+                const unsigned pair = (unsigned) (v % 100) * 2;
+                v /= 100;
+                p -= 2;
+                p[0] = digit_pairs[pair];
+                p[1] = digit_pairs[pair + 1];
+            }
+            if (v >= 10) {
+                p -= 2;
+                p[0] = digit_pairs[v * 2];
+                p[1] = digit_pairs[v * 2 + 1];
+            }
+            else {
+                *--p = (char) ('0' + v);
+            }
+            out.append(p, buf + sizeof(buf) - p);
+        }
+
+        static void append_int(std::string& out, std::int64_t v) {
+            if (v < 0) {
+                out.push_back('-');
+                append_uint(out, (std::uint64_t) 0 - (std::uint64_t) v);
+                return;
+            }
+            append_uint(out, (std::uint64_t) v);
+        }
+
+        static void decode_mer_code(std::uint64_t code, int k, std::string &s) {
+            s.resize(k);
+            for (int i = k - 1; i >= 0; --i, code >>= 2) {
+                s[i] = "ACGT"[code & 3];
+            }
+        }
+
+        static unsigned char base_complement(unsigned char b) {
+            static const unsigned char base_complement_map[256] = {
                   0,   1,   2,   3,   4,   5,   6,   7,   8,   9,  10,  11,  12,  13,  14,  15,
                  16,  17,  18,  19,  20,  21,  22,  23,  24,  25,  26,  27,  28,  29,  30,  31,
                  32,  33,  34,  35,  36,  37,  38,  39,  40,  41,  42,  43,  44,  45,  46,  47,
@@ -149,10 +779,56 @@ namespace kmer_counter
                 224, 225, 226, 227, 228, 229, 230, 231, 232, 233, 234, 235, 236, 237, 238, 239,
                 240, 241, 242, 243, 244, 245, 246, 247, 248, 249, 250, 251, 252, 253, 254, 255
             };
+            return base_complement_map[b];
+        }
+
+        static void reverse_complement_string(std::string &s) {
             std::reverse(s.begin(), s.end());
             for (auto i = s.begin(); i != s.end(); ++i) {
-                *i = base_complement_map[(int) *i];
+                *i = base_complement((unsigned char) *i);
+            }
+        }
+
+        static void reverse_complement_string(const char* s, size_t len, std::string &rc) {
+            /* Reverse complement of s[0, len) into rc, reusing its storage */
+            rc.resize(len);
+            for (size_t i = 0; i < len; ++i) {
+                rc[i] = base_complement((unsigned char) s[len - 1 - i]);
+            }
+        }
+
+        static size_t next_line_start(const char* data, size_t len, size_t offset) {
+            /* Offset of the first line starting at or after offset */
+            if (offset == 0) {
+                return offset;
             }
+            const char* nl = static_cast<const char*>(memchr(data + offset - 1, '\n', len - offset + 1));
+            return nl ? (size_t) (nl - data) + 1 : len;
+        }
+
+        static bool parse_position(const char* field, size_t field_len, std::uint64_t& position) {
+            /* Unsigned decimal field, as a BED start or stop coordinate */
+            position = 0;
+            for (size_t i = 0; i < field_len; ++i) {
+                if ((field[i] < '0') || (field[i] > '9')) {
+                    return false;
+                }
+                position = 10 * position + (field[i] - '0');
+            }
+            return field_len > 0;
+        }
+
+        static bool next_field(const char*& cursor, const char* end, const char*& field, size_t& field_len) {
+            /* Next whitespace-delimited field in [cursor, end), as sscanf("%s") would read it */
+            while ((cursor < end) && isspace((unsigned char) *cursor)) {
+                cursor++;
+            }
+            field = cursor;
+            while ((cursor < end) && !isspace((unsigned char) *cursor)) {
+                cursor++;
+            }
+            field_len = cursor - field;
+            return field_len > 0;
         }
 
         static int do_mkdir(const char *path, mode_t mode) {
@@ -214,17 +890,963 @@ namespace kmer_counter
         ~KmerCounter();
     };
 
-    const emilib::HashMap<std::string, int>& KmerCounter::mer_counts(void) { return _mer_counts; }
-    auto KmerCounter::mer_count(const std::string& k) { return _mer_counts.count(k); }
-    void KmerCounter::mer_counts(const emilib::HashMap<std::string, int>& mc) { _mer_counts = mc; }
-    void KmerCounter::set_mer_count(const std::string& k, const int& v) { _mer_counts[k] = v; }
-    void KmerCounter::erase_mer_count(const std::string& k) { _mer_counts.erase(k); }
-    void KmerCounter::increment_mer_count(const std::string& k) { _mer_counts[k]++; }
-
-    const emilib::HashMap<std::string, int>& KmerCounter::mer_keys(void) { return _mer_keys; }
-    void KmerCounter::mer_keys(const emilib::HashMap<std::string, int>& mk) { _mer_keys = mk; }
-    void KmerCounter::set_mer_key(const std::string& k, const int& v) { _mer_keys[k] = v; }
-    auto KmerCounter::mer_key(const std::string& k) { return _mer_keys[k]; }
+    template <typename FnT>
+    void KmerCountTable::for_each(FnT fn) const {
+        for (auto iter = _touched.begin(); iter != _touched.end(); ++iter) {
+            std::uint64_t rc = KmerCounter::reverse_complement_code(*iter, _k);
+            fn(*iter, rc, count(std::min(*iter, rc)));
+        }
+    }
+    template <typename FnT>
+    void KmerCounter::for_each_kmer_code(KmerCountState& state, FnT fn) {
+        /* same k-mers, orientations and order as the text output, as packed codes (k <= 32) */
+        state.mer_code_counts.for_each([&](const std::uint64_t& code, const std::uint64_t& rc_code, const std::uint64_t& count) {
+            const bool flip = this->write_canonical && (code > rc_code);
+            fn(flip ? rc_code : code, count);
+            if (this->write_reverse_complement && (code != rc_code)) {
+                fn(flip ? code : rc_code, count);
+            }
+        });
+    }
+    template <typename FnT>
+    void KmerCounter::for_each_kmer_key(KmerCountState& state, FnT fn) {
+        /* same k-mers, orientations and order as the text output, as packed codes or mer-keys (k <= 32) */
+        this->for_each_kmer_code(state, [&](const std::uint64_t& code, const std::uint64_t& count) {
+            fn(this->map_keys ? (std::uint64_t) this->mer_key(code) : code, count);
+        });
+    }
+
+    template <int K>
+    void KmerCounter::count_mer_codes(KmerCountState& state, const char* sequence, size_t sequence_len, const char* quality) {
+        /* k is a constant here, so the window masks and shifts are too; see count_mer_codes_kernel() */
+        const int k = K;
+        const int rc_shift = 2 * (K - 1);
+        const std::uint64_t mask = (K >= 32) ? UINT64_MAX : ((1ULL << (2 * (K % 32))) - 1);
+        const bool double_count_palindromes = this->double_count_palindromes;
+        KmerCountTable& counts = state.mer_code_counts;
+        std::uint64_t mer_f = state.mer_f;
+        std::uint64_t mer_r = state.mer_r;
+        int valid_len = state.valid_len;
+        // windows of one 64-base block, counted together so their table lookups overlap
+        std::uint64_t batch_c[64];
+        std::uint64_t batch_observed[64];
+        std::uint64_t batch_n[64];
+        size_t batched = 0;
+
+        encode_sequence(sequence, sequence_len, state.sequence_codes, state.ambiguous_bases);
+        if (quality && (this->min_qual() > 0)) {
+            // low-quality bases break windows exactly as ambiguous ones do
+            mask_low_quality(quality, sequence_len, this->min_qual(), state.ambiguous_bases);
+        }
+        const unsigned char* codes = state.sequence_codes.data();
+
+        // roll forward and reverse-complement codes across sequence, one base at a time
+        auto roll = [&](const std::uint64_t& base) {
+            mer_f = ((mer_f << 2) | base) & mask;
+            mer_r = (mer_r >> 2) | ((3 - base) << rc_shift);
+            if (valid_len < k) {
+                ++valid_len;
+                if (valid_len < k) {
+                    return;
+                }
+            }
+            #ifdef DEBUG
+            std::fprintf(stderr, "[%016" PRIx64 " : %016" PRIx64 "]\n", mer_f, mer_r);
+            #endif
+            // count under the canonical (lesser) code; a palindrome is counted once, unless asked to
+            batch_c[batched] = std::min(mer_f, mer_r);
+            batch_observed[batched] = mer_f;
+            batch_n[batched] = ((mer_f == mer_r) && double_count_palindromes) ? 2 : 1;
+            ++batched;
+        };
+
+        // walk the ambiguous-base bitmap 64 bases at a time, so clean blocks need no per-base check
+        for (size_t w = 0; w < state.ambiguous_bases.size(); ++w) {
+            const size_t start = w * 64;
+            const size_t end = std::min(sequence_len, start + 64);
+            const std::uint64_t ambiguous = state.ambiguous_bases[w];
+            const std::uint64_t block = ((end - start) == 64) ? UINT64_MAX : ((1ULL << (end - start)) - 1);
+            if (ambiguous == 0) {
+                for (size_t i = start; i < end; ++i) {
+                    roll(codes[i]);
+                }
+            }
+            else if (ambiguous == block) {
+                valid_len = 0;
+            }
+            else {
+                for (size_t i = start; i < end; ++i) {
+                    if ((ambiguous >> (i - start)) & 1) {
+                        // ambiguous base: no window may include it
+                        valid_len = 0;
+                        continue;
+                    }
+                    roll(codes[i]);
+                }
+            }
+            counts.increment_batch(batch_c, batch_observed, batch_n, batched);
+            batched = 0;
+        }
+
+        // carry the window over to the next piece of this sequence
+        state.mer_f = mer_f;
+        state.mer_r = mer_r;
+        state.valid_len = valid_len;
+    }
+    template <int... Ks>
+    KmerCounter::CountMerCodesFn KmerCounter::count_mer_codes_kernel(const int& k, std::integer_sequence<int, Ks...>) {
+        /* count_mer_codes<K> for each K in Ks + 1, picked once k is known (1 <= k <= sizeof...(Ks)) */
+        static const CountMerCodesFn kernels[] = { &KmerCounter::count_mer_codes<Ks + 1>... };
+        return kernels[k - 1];
+    }
+
+    template <typename KeyT, typename FnT>
+    void KmerCounter::write_aggregate_table(std::vector<std::vector<std::pair<KeyT, std::uint64_t>>>& entries, FnT format) {
+        /*
+         * Sample-sort merge of per-thread (canonical key, count) lists. Splitters
+         * drawn from a sample of keys cut the key space into ordered partitions
+         * of similar size; every list is scattered across them in parallel, then
+         * each partition is sorted, summed and formatted on its own, and the
+         * partitions are written in key order with an abundance histogram.
+         */
+        struct AggregateBatch {
+            size_t index;
+            std::vector<std::pair<KeyT, std::uint64_t>> entries;
+            std::string output;
+            std::map<std::uint64_t, std::uint64_t> histogram;
+        };
+        const size_t n_parts = 4 * (size_t) this->threads();
+        const size_t n_lists = entries.size();
+        std::vector<KeyT> splitters;
+        std::vector<std::vector<std::vector<std::pair<KeyT, std::uint64_t>>>> buckets(n_lists, std::vector<std::vector<std::pair<KeyT, std::uint64_t>>>(n_parts));
+        std::vector<std::thread> workers;
+        FILE* os = this->results_kmer_count_stream();
+
+        for (auto iter = entries.begin(); iter != entries.end(); ++iter) {
+            const size_t stride = std::max((size_t) 1, iter->size() / 256);
+            for (size_t i = 0; i < iter->size(); i += stride) {
+                splitters.push_back((*iter)[i].first);
+            }
+        }
+        std::sort(splitters.begin(), splitters.end());
+        std::vector<KeyT> samples;
+        samples.swap(splitters);
+        for (size_t i = 1; (i < n_parts) && !samples.empty(); ++i) {
+            splitters.push_back(samples[i * samples.size() / n_parts]);
+        }
+
+        for (size_t w = 0; w < n_lists; ++w) {
+            workers.emplace_back([&entries, &buckets, &splitters, w]() {
+                for (auto iter = entries[w].begin(); iter != entries[w].end(); ++iter) {
+                    const size_t part = std::upper_bound(splitters.begin(), splitters.end(), iter->first) - splitters.begin();
+                    buckets[w][part].push_back(std::move(*iter));
+                }
+                std::vector<std::pair<KeyT, std::uint64_t>>().swap(entries[w]);
+            });
+        }
+        for (auto iter = workers.begin(); iter != workers.end(); ++iter) {
+            iter->join();
+        }
+        workers.clear();
+
+        OrderedBatchQueue<AggregateBatch> queue(2 * (size_t) this->threads());
+        for (int i = 0; i < this->threads(); ++i) {
+            workers.emplace_back([&queue, &format]() {
+                FnT format_row(format);
+                while (std::unique_ptr<AggregateBatch> batch = queue.take()) {
+                    std::vector<std::pair<KeyT, std::uint64_t>>& part = batch->entries;
+                    std::sort(part.begin(), part.end(), [](const std::pair<KeyT, std::uint64_t>& a, const std::pair<KeyT, std::uint64_t>& b) { return a.first < b.first; });
+                    for (size_t j = 0; j < part.size();) {
+                        std::uint64_t count = 0;
+                        size_t run = j;
+                        for (; (run < part.size()) && (part[run].first == part[j].first); ++run) {
+                            count += part[run].second;
+                        }
+                        format_row(batch->output, part[j].first, count);
+                        batch->histogram[count]++;
+                        j = run;
+                    }
+                    std::vector<std::pair<KeyT, std::uint64_t>>().swap(part);
+                    queue.finish(std::move(batch));
+                }
+            });
+        }
+        std::map<std::uint64_t, std::uint64_t> histogram;
+        std::thread writer([&queue, &histogram, os]() {
+            while (std::unique_ptr<AggregateBatch> batch = queue.next_finished()) {
+                std::fwrite(batch->output.data(), 1, batch->output.length(), os);
+                for (auto iter = batch->histogram.begin(); iter != batch->histogram.end(); ++iter) {
+                    histogram[iter->first] += iter->second;
+                }
+            }
+        });
+        for (size_t p = 0; p < n_parts; ++p) {
+            std::unique_ptr<AggregateBatch> batch(new AggregateBatch);
+            for (size_t w = 0; w < n_lists; ++w) {
+                batch->entries.insert(batch->entries.end(), std::make_move_iterator(buckets[w][p].begin()), std::make_move_iterator(buckets[w][p].end()));
+                std::vector<std::pair<KeyT, std::uint64_t>>().swap(buckets[w][p]);
+            }
+            queue.push(std::move(batch));
+        }
+        queue.close();
+        for (auto iter = workers.begin(); iter != workers.end(); ++iter) {
+            iter->join();
+        }
+        writer.join();
+
+        // number of distinct canonical k-mers seen exactly n times
+        std::string histogram_fn(this->results_dir() + "/histogram.txt");
+        FILE* histogram_fp = std::fopen(histogram_fn.c_str(), "w");
+        if (!histogram_fp) {
+            std::fprintf(stderr, "Error: Output file handle to histogram could not be created\n");
+            std::exit(ENODATA); /* No message is available on the STREAM head read queue (POSIX.1) */
+        }
+        std::string out;
+        for (auto iter = histogram.begin(); iter != histogram.end(); ++iter) {
+            append_uint(out, iter->first);
+            out.push_back('\t');
+            append_uint(out, iter->second);
+            out.push_back('\n');
+        }
+        std::fwrite(out.data(), 1, out.length(), histogram_fp);
+        std::fclose(histogram_fp);
+    }
+
+    void KmerCountTable::merge(const KmerCountTable& other) {
+        // visiting other in first-touched order keeps this table's order first-seen overall
+        other.for_each([this](const std::uint64_t& c, const std::uint64_t& rc, const std::uint64_t& n) { increment(std::min(c, rc), c, n); });
+    }
+    void KmerCountTable::initialize(const int& k, const std::uint64_t& dense_max) {
+        _k = k;
+        _dense = (k > 0) && (2 * k < 64) && ((1ULL << (2 * k)) <= dense_max);
+        if (_dense) {
+            _dense_counts.assign(1ULL << (2 * k), 0);
+        }
+    }
+    void KmerCountTable::share(SharedKmerCounts* shared) { _shared = shared; }
+    bool KmerCountTable::dense(void) const { return _dense; }
+    size_t KmerCountTable::size(void) const { return _touched.size(); }
+    void KmerCountTable::increment(const std::uint64_t& c, const std::uint64_t& observed, const std::uint64_t& n) {
+        if (_shared) {
+            if (!_shared->add(c, n)) {
+                std::fprintf(stderr, "Error: Shared k-mer table is full after %zu distinct k-mers; set --expected-kmers higher\n", _shared->size());
+                std::exit(ENOMEM);
+            }
+            return;
+        }
+        std::uint64_t& v = _dense ? _dense_counts[c] : _sparse_counts[c];
+        if (v == 0) {
+            _touched.push_back(observed);
+        }
+        v += n;
+    }
+    void KmerCountTable::increment_batch(const std::uint64_t* c, const std::uint64_t* observed, const std::uint64_t* n, size_t count) {
+        // for larger k neither table fits in cache: fetch every slot of the batch before touching any
+        if (_shared) {
+            for (size_t i = 0; i < count; ++i) {
+                increment(c[i], observed[i], n[i]);
+            }
+        }
+        else if (_dense) {
+            for (size_t i = 0; i < count; ++i) {
+                __builtin_prefetch(&_dense_counts[c[i]]);
+            }
+            for (size_t i = 0; i < count; ++i) {
+                increment(c[i], observed[i], n[i]);
+            }
+        }
+        else {
+            _sparse_counts.increment_batch(c, n, count, [&](size_t i) { _touched.push_back(observed[i]); });
+        }
+    }
+    std::uint64_t KmerCountTable::count(const std::uint64_t& c) const {
+        if (_dense) {
+            return _dense_counts[c];
+        }
+        const std::uint64_t* n = _sparse_counts.try_get(c);
+        return n ? *n : 0;
+    }
+    void KmerCountTable::clear(void) {
+        for (auto iter = _touched.begin(); iter != _touched.end(); ++iter) {
+            std::uint64_t c = std::min(*iter, KmerCounter::reverse_complement_code(*iter, _k));
+            if (_dense) {
+                _dense_counts[c] = 0;
+            }
+            else {
+                _sparse_counts.erase(c);
+            }
+        }
+        _touched.clear();
+    }
+
+    GzipInput::~GzipInput() { close(); }
+    bool GzipInput::is_gzip(const char* data, size_t len) {
+        return (len >= 2) && ((unsigned char) data[0] == 0x1f) && ((unsigned char) data[1] == 0x8b);
+    }
+    bool GzipInput::is_bgzf(const char* data, size_t len) {
+        /* gzip member with FEXTRA set whose first extra subfield is BC, as BGZF writes it */
+        return is_gzip(data, len) && (len >= 18) && ((unsigned char) data[3] & 4) && (data[12] == 'B') && (data[13] == 'C');
+    }
+    void GzipInput::open(const char* data, size_t len, FILE* fp, int threads) {
+        /* data is the whole input, or, when fp is given, its first bytes already read from fp */
+        const int n_workers = std::max(1, threads);
+        if (fp) {
+            _pending.assign(data, len);
+        }
+        else {
+            _src = data;
+            _src_len = len;
+        }
+        _fp = fp;
+        _bgzf = is_bgzf(data, len);
+        _queue.reset(new OrderedBatchQueue<Block>(4 * n_workers));
+
+        // reader cuts compressed input into batches: whole BGZF blocks, or fixed-size gzip slices
+        _threads.emplace_back([this]() {
+            for (;;) {
+                std::unique_ptr<Block> block(new Block);
+                if (_bgzf) {
+                    while ((block->compressed.length() < KMER_COUNTER_READ_BLOCK) && read_bgzf_block(block->compressed)) {}
+                }
+                else {
+                    block->compressed.resize(KMER_COUNTER_READ_BLOCK);
+                    block->compressed.resize(read_compressed(&block->compressed[0], block->compressed.length()));
+                }
+                if (block->compressed.empty()) {
+                    break;
+                }
+                _queue->push(std::move(block));
+            }
+            _queue->close();
+        });
+
+        // plain gzip is one inflate stream, so it gets one worker; BGZF blocks inflate independently
+        for (int i = 0; i < (_bgzf ? n_workers : 1); ++i) {
+            _threads.emplace_back([this]() {
+                z_stream z;
+                bool member_end = true;
+                std::memset(&z, 0, sizeof(z));
+                if (inflateInit2(&z, 15 + 16) != Z_OK) {
+                    std::fprintf(stderr, "Error: Could not initialize gzip decompression\n");
+                    std::exit(ENOMEM);
+                }
+                while (std::unique_ptr<Block> block = _queue->take()) {
+                    if (_bgzf) {
+                        inflateReset(&z);
+                        member_end = false;
+                    }
+                    if (!inflate_members(z, member_end, block->compressed, block->data) || (_bgzf && !member_end)) {
+                        std::fprintf(stderr, "Error: Compressed input is corrupt\n");
+                        std::exit(EIO);
+                    }
+                    std::string().swap(block->compressed);
+                    _queue->finish(std::move(block));
+                }
+                if (!member_end) {
+                    std::fprintf(stderr, "Error: Compressed input is truncated\n");
+                    std::exit(EIO);
+                }
+                inflateEnd(&z);
+            });
+        }
+    }
+    size_t GzipInput::read_compressed(char* buf, size_t len) {
+        size_t copied = std::min(len, _pending.length());
+        std::memcpy(buf, _pending.data(), copied);
+        _pending.erase(0, copied);
+        if (_src) {
+            size_t mapped = std::min(len - copied, _src_len - _src_pos);
+            std::memcpy(buf + copied, _src + _src_pos, mapped);
+            _src_pos += mapped;
+            return copied + mapped;
+        }
+        while (copied < len) {
+            size_t block_read = std::fread(buf + copied, 1, len - copied, _fp);
+            if (block_read == 0) {
+                break;
+            }
+            copied += block_read;
+        }
+        return copied;
+    }
+    bool GzipInput::read_bgzf_block(std::string& compressed) {
+        /* append one whole BGZF block: 12-byte gzip header, extra field holding BSIZE, then the rest */
+        char header[12];
+        size_t header_read = read_compressed(header, sizeof(header));
+        if (header_read == 0) {
+            return false;
+        }
+        if ((header_read < sizeof(header)) || !is_gzip(header, header_read) || !((unsigned char) header[3] & 4)) {
+            std::fprintf(stderr, "Error: Compressed input is not in BGZF format\n");
+            std::exit(EIO);
+        }
+        size_t xlen = (unsigned char) header[10] | ((unsigned char) header[11] << 8);
+        std::string extra(xlen, '\0');
+        size_t bsize = 0;
+        if (read_compressed(&extra[0], xlen) < xlen) {
+            std::fprintf(stderr, "Error: Compressed input is truncated\n");
+            std::exit(EIO);
+        }
+        for (size_t i = 0; i + 4 <= xlen; i += 4 + ((unsigned char) extra[i + 2] | ((unsigned char) extra[i + 3] << 8))) {
+            if ((extra[i] == 'B') && (extra[i + 1] == 'C') && (i + 6 <= xlen)) {
+                bsize = (unsigned char) extra[i + 4] | ((unsigned char) extra[i + 5] << 8);
+            }
+        }
+        if (bsize + 1 < sizeof(header) + xlen) {
+            std::fprintf(stderr, "Error: Compressed input is not in BGZF format\n");
+            std::exit(EIO);
+        }
+        size_t rest = bsize + 1 - sizeof(header) - xlen;
+        size_t start = compressed.length();
+        compressed.append(header, sizeof(header)).append(extra);
+        compressed.resize(start + bsize + 1);
+        if (read_compressed(&compressed[start + sizeof(header) + xlen], rest) < rest) {
+            std::fprintf(stderr, "Error: Compressed input is truncated\n");
+            std::exit(EIO);
+        }
+        return true;
+    }
+    bool GzipInput::inflate_members(z_stream& z, bool& member_end, const std::string& in, std::string& out) {
+        /* inflate all of in, starting new gzip members as they come; stops at trailing non-gzip bytes */
+        z.next_in = (Bytef*) in.data();
+        z.avail_in = (uInt) in.length();
+        while (z.avail_in > 0) {
+            if (member_end) {
+                if ((z.avail_in >= 2) && ((z.next_in[0] != 0x1f) || (z.next_in[1] != 0x8b))) {
+                    break;
+                }
+                inflateReset(&z);
+                member_end = false;
+            }
+            size_t out_len = out.length();
+            out.resize(out_len + std::max((size_t) z.avail_in * 4, (size_t) 65536));
+            z.next_out = (Bytef*) &out[out_len];
+            z.avail_out = (uInt) (out.length() - out_len);
+            int ret = inflate(&z, Z_NO_FLUSH);
+            out.resize(out.length() - z.avail_out);
+            if (ret == Z_STREAM_END) {
+                member_end = true;
+            }
+            else if ((ret != Z_OK) && (ret != Z_BUF_ERROR)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    size_t GzipInput::read(char* buf, size_t len) {
+        size_t copied = 0;
+        while (copied < len) {
+            if (!_block || (_block_pos == _block->data.length())) {
+                _block = _queue->next_finished();
+                _block_pos = 0;
+                if (!_block) {
+                    break;
+                }
+                continue;
+            }
+            size_t block_copied = std::min(len - copied, _block->data.length() - _block_pos);
+            std::memcpy(buf + copied, _block->data.data() + _block_pos, block_copied);
+            _block_pos += block_copied;
+            copied += block_copied;
+        }
+        return copied;
+    }
+    void GzipInput::close(void) {
+        if (_queue) {
+            // drain unread batches, so the reader is never left blocked on a full queue
+            while (_queue->next_finished()) {}
+        }
+        for (auto iter = _threads.begin(); iter != _threads.end(); ++iter) {
+            iter->join();
+        }
+        _threads.clear();
+        _queue.reset();
+        _block.reset();
+    }
+
+    InputReader::~InputReader() { close(); }
+    void InputReader::open(FILE* fp, int threads) {
+        struct stat fp_stat;
+        close();
+        if ((fstat(fileno(fp), &fp_stat) == 0) && S_ISREG(fp_stat.st_mode)) {
+            if (fp_stat.st_size == 0) {
+                _mapped = true;
+                return;
+            }
+            void* map = mmap(NULL, (size_t) fp_stat.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+            if (map != MAP_FAILED) {
+                madvise(map, (size_t) fp_stat.st_size, MADV_SEQUENTIAL);
+                _map = map;
+                _map_len = (size_t) fp_stat.st_size;
+                _data = static_cast<const char*>(map);
+                _len = _map_len;
+                _mapped = true;
+                if (GzipInput::is_gzip(_data, _len)) {
+                    // the mapping now only feeds the inflater; lines come from the stream buffer
+                    _gzip.reset(new GzipInput);
+                    _gzip->open(_data, _len, NULL, threads);
+                    _mapped = false;
+                    _buffer.resize(KMER_COUNTER_READ_BLOCK);
+                    _data = _buffer.data();
+                    _len = 0;
+                }
+                return;
+            }
+        }
+        // not mappable: stream it in blocks, after a first read to sniff for gzip
+        _fp = fp;
+        _buffer.resize(KMER_COUNTER_READ_BLOCK);
+        _data = _buffer.data();
+        _len = std::fread(_buffer.data(), 1, _buffer.size(), _fp);
+        _eof = (_len == 0);
+        if (GzipInput::is_gzip(_data, _len)) {
+            _gzip.reset(new GzipInput);
+            _gzip->open(_data, _len, _fp, threads);
+            _len = 0;
+        }
+    }
+    void InputReader::open(const char* data, size_t len) {
+        close();
+        _data = data;
+        _len = len;
+        _mapped = true;
+    }
+    void InputReader::close(void) {
+        // stop the inflater before unmapping what it reads from
+        _gzip.reset();
+        if (_map) {
+            munmap(_map, _map_len);
+        }
+        _fp = NULL;
+        _map = NULL;
+        _map_len = 0;
+        _data = NULL;
+        _len = 0;
+        _pos = 0;
+        _mapped = false;
+        _eof = false;
+        std::vector<char>().swap(_buffer);
+    }
+    size_t InputReader::read_block(char* buf, size_t len) {
+        return _gzip ? _gzip->read(buf, len) : std::fread(buf, 1, len, _fp);
+    }
+    bool InputReader::mapped(void) const { return _mapped; }
+    bool InputReader::stable(const char* p) const { return _mapped && (p >= _data) && (p < _data + _len); }
+    const char* InputReader::data(void) const { return _data; }
+    size_t InputReader::size(void) const { return _len; }
+    bool InputReader::next_line(const char*& line, size_t& line_len) {
+        bool line_end = false;
+        return read_line(line, line_len, line_end, true);
+    }
+    bool InputReader::next_line_part(const char*& part, size_t& part_len, bool& line_end) {
+        return read_line(part, part_len, line_end, false);
+    }
+    bool InputReader::read_line(const char*& line, size_t& line_len, bool& line_end, bool grow) {
+        size_t scanned = _pos;
+        for (;;) {
+            const char* nl = (scanned < _len) ? static_cast<const char*>(memchr(_data + scanned, '\n', _len - scanned)) : NULL;
+            line_end = true;
+            if (nl) {
+                line = _data + _pos;
+                line_len = nl - line;
+                _pos = (nl - _data) + 1;
+                return true;
+            }
+            if (_mapped || _eof) {
+                if (_pos < _len) {
+                    line = _data + _pos;
+                    line_len = _len - _pos;
+                    _pos = _len;
+                    return true;
+                }
+                return false;
+            }
+            size_t partial_len = _len - _pos;
+            if ((partial_len == _buffer.size()) && !grow) {
+                // hand out all but the last byte, so a '\r' before the '\n' stays with the line end
+                line = _data + _pos;
+                line_len = partial_len - 1;
+                line_end = false;
+                _pos = _len - 1;
+                return true;
+            }
+            // slide the partial line to the front, grow if it fills the buffer, and read more
+            std::memmove(_buffer.data(), _buffer.data() + _pos, partial_len);
+            if (partial_len == _buffer.size()) {
+                _buffer.resize(2 * _buffer.size());
+            }
+            size_t block_read = read_block(_buffer.data() + partial_len, _buffer.size() - partial_len);
+            _eof = (block_read == 0);
+            _data = _buffer.data();
+            _len = partial_len + block_read;
+            _pos = 0;
+            scanned = partial_len;
+        }
+    }
+
+    void CsrWriter::put_u32(std::string& out, std::uint32_t v) {
+        for (int i = 0; i < 4; ++i, v >>= 8) {
+            out.push_back((char) (v & 0xff));
+        }
+    }
+    void CsrWriter::put_u64(std::string& out, std::uint64_t v) {
+        for (int i = 0; i < 8; ++i, v >>= 8) {
+            out.push_back((char) (v & 0xff));
+        }
+    }
+    void CsrWriter::copy_stream(FILE* is, FILE* os) {
+        std::vector<char> block(KMER_COUNTER_WRITE_BLOCK);
+        size_t block_read = 0;
+        std::rewind(is);
+        while ((block_read = std::fread(block.data(), 1, block.size(), is)) > 0) {
+            std::fwrite(block.data(), 1, block_read, os);
+        }
+    }
+    FILE* CsrWriter::spool(void) {
+        FILE* fp = tmpfile();
+        if (!fp) {
+            std::fprintf(stderr, "Error: Temporary file for sparse count matrix could not be created\n");
+            std::exit(ENODATA); /* No message is available on the STREAM head read queue (POSIX.1) */
+        }
+        return fp;
+    }
+    void CsrWriter::open(FILE* os, int k, int offset, std::uint32_t flags) {
+        _os = os;
+        _keys = os;
+        _counts = spool();
+        _k = (std::uint32_t) k;
+        _offset = offset;
+        _flags = flags;
+        // header is rewritten with the real sizes on finish
+        std::fwrite(std::string(64, '\0').data(), 1, 64, _os);
+    }
+    void CsrWriter::open_fragment(void) {
+        _keys = spool();
+        _counts = spool();
+    }
+    void CsrWriter::append_entry(CsrBlock& block, std::uint64_t key, std::uint64_t count) {
+        if (count > UINT32_MAX) {
+            std::fprintf(stderr, "Error: A k-mer count of %" PRIu64 " does not fit the 32-bit CSR counts\n", count);
+            std::exit(ERANGE);
+        }
+        put_u64(block.keys, key);
+        put_u32(block.counts, (std::uint32_t) count);
+    }
+    void CsrWriter::append(CsrBlock& block) {
+        std::fwrite(block.keys.data(), 1, block.keys.length(), _keys);
+        std::fwrite(block.counts.data(), 1, block.counts.length(), _counts);
+        _row_nnz.insert(_row_nnz.end(), block.row_nnz.begin(), block.row_nnz.end());
+        _nnz += block.keys.length() / 8;
+        block.keys.clear();
+        block.counts.clear();
+        block.row_nnz.clear();
+    }
+    void CsrWriter::append(CsrWriter& fragment) {
+        copy_stream(fragment._keys, _keys);
+        copy_stream(fragment._counts, _counts);
+        _row_nnz.insert(_row_nnz.end(), fragment._row_nnz.begin(), fragment._row_nnz.end());
+        _nnz += fragment._nnz;
+        std::fclose(fragment._keys);
+        std::fclose(fragment._counts);
+        fragment._keys = NULL;
+        fragment._counts = NULL;
+    }
+    void CsrWriter::finish(void) {
+        if (!_os) {
+            return;
+        }
+        const std::uint64_t keys_offset = 64;
+        const std::uint64_t counts_offset = keys_offset + 8 * _nnz;
+        const std::uint64_t row_ptr_offset = (counts_offset + 4 * _nnz + 7) & ~((std::uint64_t) 7);
+        std::string tail;
+
+        copy_stream(_counts, _os);
+        std::fclose(_counts);
+        tail.assign(row_ptr_offset - (counts_offset + 4 * _nnz), '\0');
+        std::uint64_t row_ptr = 0;
+        put_u64(tail, row_ptr);
+        for (auto iter = _row_nnz.begin(); iter != _row_nnz.end(); ++iter) {
+            row_ptr += *iter;
+            put_u64(tail, row_ptr);
+        }
+        std::fwrite(tail.data(), 1, tail.length(), _os);
+
+        std::string header("KMERCSR1", 8);
+        put_u32(header, _k);
+        put_u32(header, (std::uint32_t) _offset);
+        put_u32(header, _flags);
+        put_u32(header, 0);
+        put_u64(header, _row_nnz.size());
+        put_u64(header, _nnz);
+        put_u64(header, keys_offset);
+        put_u64(header, counts_offset);
+        put_u64(header, row_ptr_offset);
+        std::fseek(_os, 0, SEEK_SET);
+        std::fwrite(header.data(), 1, header.length(), _os);
+        std::fflush(_os);
+        _os = NULL;
+    }
+
+    void NpyWriter::write_at(const void* buf, size_t len, std::uint64_t offset) {
+        const char* p = static_cast<const char*>(buf);
+        while (len > 0) {
+            ssize_t written = pwrite(_fd, p, len, (off_t) offset);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                std::fprintf(stderr, "Error: Could not write dense count matrix row (%s)\n", std::strerror(errno));
+                std::exit(EIO);
+            }
+            p += written;
+            len -= written;
+            offset += written;
+        }
+    }
+    void NpyWriter::write_header(void) {
+        char dict[header_len];
+        std::string header("\x93NUMPY\x01\x00", 8);
+        const int dict_len = std::snprintf(dict, sizeof(dict), "{'descr': '%s', 'fortran_order': False, 'shape': (%" PRIu64 ", %" PRIu64 "), }",
+                                           (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) ? "<u4" : ">u4", _rows.load(), _columns);
+        // header length as little-endian uint16, then the dict padded with spaces to a newline at byte header_len - 1
+        header.push_back((char) ((header_len - 10) & 0xff));
+        header.push_back((char) ((header_len - 10) >> 8));
+        header.append(dict, dict_len);
+        header.append(header_len - 1 - header.length(), ' ');
+        header.push_back('\n');
+        write_at(header.data(), header.length(), 0);
+    }
+    void NpyWriter::open(FILE* os, int k) {
+        _fd = fileno(os);
+        _columns = 1ULL << (2 * k);
+        write_header();
+    }
+    void NpyWriter::write_row(std::uint64_t row, const std::uint32_t* counts) {
+        const std::uint64_t row_len = _columns * sizeof(std::uint32_t);
+        std::uint64_t rows = _rows.load();
+        write_at(counts, row_len, header_len + row * row_len);
+        while ((rows < row + 1) && !_rows.compare_exchange_weak(rows, row + 1)) {
+        }
+    }
+    void NpyWriter::finish(void) {
+        if (_fd < 0) {
+            return;
+        }
+        write_header();
+        _fd = -1;
+    }
+
+    ReferenceGenome::~ReferenceGenome() {
+        if (_map) {
+            munmap(_map, _map_len);
+        }
+    }
+    void ReferenceGenome::open(const std::string& fn) {
+        struct stat fn_stat;
+        int fd = ::open(fn.c_str(), O_RDONLY);
+        if ((fd < 0) || (fstat(fd, &fn_stat) != 0) || (fn_stat.st_size == 0)) {
+            std::fprintf(stderr, "Error: Reference file could not be opened (%s)\n", fn.c_str());
+            std::exit(ENODATA); /* No message is available on the STREAM head read queue (POSIX.1) */
+        }
+        _map_len = (size_t) fn_stat.st_size;
+        _map = mmap(NULL, _map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (_map == MAP_FAILED) {
+            std::fprintf(stderr, "Error: Reference file could not be mapped (%s)\n", fn.c_str());
+            std::exit(ENOMEM);
+        }
+        _data = static_cast<const unsigned char*>(_map);
+
+        // 2bit files start with a signature in either byte order; anything else is FASTA
+        if (_map_len >= 16) {
+            std::uint32_t signature;
+            std::memcpy(&signature, _data, sizeof(signature));
+            _two_bit = (signature == 0x1A412743U) || (signature == 0x4327411AU);
+            _swapped = (signature == 0x4327411AU);
+        }
+        if (_two_bit) {
+            this->load_two_bit();
+        }
+        else {
+            this->load_fai(fn + ".fai");
+        }
+    }
+    bool ReferenceGenome::loaded(void) const { return _data != NULL; }
+    std::uint32_t ReferenceGenome::read_u32(size_t offset) const {
+        std::uint32_t v;
+        if (offset + sizeof(v) > _map_len) {
+            std::fprintf(stderr, "Error: Reference 2bit file is truncated\n");
+            std::exit(EIO);
+        }
+        std::memcpy(&v, _data + offset, sizeof(v));
+        return _swapped ? __builtin_bswap32(v) : v;
+    }
+    void ReferenceGenome::load_fai(const std::string& fn) {
+        FILE* fai = std::fopen(fn.c_str(), "r");
+        char* line = NULL;
+        size_t line_cap = 0;
+        ssize_t line_len = 0;
+        Sequence sequence;
+        if (!fai) {
+            std::fprintf(stderr, "Error: Reference FASTA index does not exist (%s); create it with 'samtools faidx'\n", fn.c_str());
+            std::exit(ENODATA); /* No message is available on the STREAM head read queue (POSIX.1) */
+        }
+        while ((line_len = getline(&line, &line_cap, fai)) > 0) {
+            if (line[0] == '\n') {
+                continue;
+            }
+            // name, then length, offset of the first base, bases and bytes per line
+            const char* tab = static_cast<const char*>(std::memchr(line, '\t', (size_t) line_len));
+            if (!tab || (std::sscanf(tab + 1, "%" SCNu64 "\t%" SCNu64 "\t%" SCNu64 "\t%" SCNu64,
+                                     &sequence.length, &sequence.offset, &sequence.line_bases, &sequence.line_width) != 4)) {
+                std::fprintf(stderr, "Error: Reference FASTA index has a malformed line (%s)\n", fn.c_str());
+                std::exit(EIO);
+            }
+            const std::string name(line, tab - line);
+            if ((sequence.line_bases == 0) || (sequence.line_width < sequence.line_bases)) {
+                std::fprintf(stderr, "Error: Reference FASTA index has an invalid line length for [%s]\n", name.c_str());
+                std::exit(EIO);
+            }
+
+            // the last base must lie inside the FASTA, or a stale index would read past the mapping
+            const std::uint64_t last = (sequence.length > 0) ? sequence.length - 1 : 0;
+            const std::uint64_t last_line = last / sequence.line_bases;
+            if ((sequence.offset > _map_len) || (last_line > (_map_len - sequence.offset) / sequence.line_width) ||
+                ((sequence.length > 0) && (sequence.offset + last_line * sequence.line_width + (last % sequence.line_bases) >= _map_len))) {
+                std::fprintf(stderr, "Error: Reference FASTA index does not match the FASTA for [%s]; recreate it with 'samtools faidx'\n", name.c_str());
+                std::exit(EIO);
+            }
+            _names[name] = _sequences.size();
+            _sequences.push_back(sequence);
+        }
+        std::free(line);
+        std::fclose(fai);
+    }
+    void ReferenceGenome::load_two_bit(void) {
+        /* header: signature, version, sequence count, reserved; then name and offset for each sequence */
+        const std::uint32_t version = this->read_u32(4);
+        const std::uint32_t sequence_count = this->read_u32(8);
+        size_t index = 16;
+        for (std::uint32_t i = 0; i < sequence_count; ++i) {
+            if (index >= _map_len) {
+                std::fprintf(stderr, "Error: Reference 2bit file is truncated\n");
+                std::exit(EIO);
+            }
+            const size_t name_len = _data[index];
+            std::string name(reinterpret_cast<const char*>(_data) + index + 1, name_len);
+            index += 1 + name_len;
+            std::uint64_t record = this->read_u32(index);
+            index += 4;
+            if (version == 1) {
+                record |= ((std::uint64_t) this->read_u32(index)) << 32;
+                index += 4;
+            }
+
+            // record: base count, N blocks, mask blocks (ignored), reserved word, then packed bases
+            Sequence sequence;
+            sequence.length = this->read_u32(record);
+            const std::uint32_t n_count = this->read_u32(record + 4);
+            size_t at = record + 8;
+            for (std::uint32_t j = 0; j < n_count; ++j) {
+                sequence.n_starts.push_back(this->read_u32(at + 4 * j));
+                sequence.n_sizes.push_back(this->read_u32(at + 4 * (n_count + j)));
+            }
+            at += 8 * (size_t) n_count;
+            const std::uint32_t mask_count = this->read_u32(at);
+            sequence.offset = at + 4 + 8 * (size_t) mask_count + 4;
+            if (sequence.offset + (sequence.length + 3) / 4 > _map_len) {
+                std::fprintf(stderr, "Error: Reference 2bit file is truncated\n");
+                std::exit(EIO);
+            }
+            _names[name] = _sequences.size();
+            _sequences.push_back(sequence);
+        }
+    }
+    void ReferenceGenome::prefetch(ReferenceCursor& cursor, const unsigned char* start, const unsigned char* end) const {
+        /* sorted intervals walk forward: ask for the next stretch of the mapping once the last one is half used */
+        const char* s = reinterpret_cast<const char*>(start);
+        const char* e = reinterpret_cast<const char*>(end);
+        if ((s >= cursor.prefetch_start) && (e + (KMER_COUNTER_PREFETCH_LEN / 2) <= cursor.prefetch_end)) {
+            return;
+        }
+        const size_t page = 4096;
+        const char* base = reinterpret_cast<const char*>(_data);
+        const char* from = base + (((size_t) (s - base)) & ~(page - 1));
+        const char* to = std::min(base + _map_len, e + KMER_COUNTER_PREFETCH_LEN);
+        madvise(const_cast<char*>(from), to - from, MADV_WILLNEED);
+        cursor.prefetch_start = from;
+        cursor.prefetch_end = to;
+    }
+    void ReferenceGenome::fetch(ReferenceCursor& cursor, const char* name, size_t name_len, std::uint64_t start, std::uint64_t stop,
+                                const std::function<void(const char*, size_t)>& on_piece) const {
+        // look the name up where it lies in the BED line, without copying it into a std::string
+        const emilib::HashMapStringRef key = { name, name_len };
+        auto found = _names.find_with_hash(key, _names.hash_of(key));
+        if ((found == _names.end()) || (start > stop) || (stop > _sequences[found->second].length)) {
+            std::fprintf(stderr, "Error: Interval [%.*s:%" PRIu64 "-%" PRIu64 "] is not within the reference\n", (int) name_len, name, start, stop);
+            std::exit(ERANGE);
+        }
+        const Sequence& sequence = _sequences[found->second];
+        if (start == stop) {
+            return;
+        }
+
+        if (!_two_bit) {
+            // each line of the interval is a view straight into the mapping
+            auto byte_offset = [&sequence](std::uint64_t p) {
+                return sequence.offset + (p / sequence.line_bases) * sequence.line_width + (p % sequence.line_bases);
+            };
+            this->prefetch(cursor, _data + byte_offset(start), _data + byte_offset(stop - 1) + 1);
+            for (std::uint64_t p = start; p < stop; ) {
+                const std::uint64_t piece_len = std::min(stop - p, sequence.line_bases - (p % sequence.line_bases));
+                on_piece(reinterpret_cast<const char*>(_data) + byte_offset(p), piece_len);
+                p += piece_len;
+            }
+            return;
+        }
+
+        // unpack four bases per byte, first base in the high bits, T C A G as 0 1 2 3
+        const unsigned char* packed = _data + sequence.offset;
+        this->prefetch(cursor, packed + start / 4, packed + (stop - 1) / 4 + 1);
+        cursor.scratch.resize(stop - start);
+        for (std::uint64_t p = start; p < stop; ++p) {
+            cursor.scratch[p - start] = "TCAG"[(packed[p >> 2] >> (6 - 2 * (p & 3))) & 3];
+        }
+        auto n_block = std::upper_bound(sequence.n_starts.begin(), sequence.n_starts.end(), (std::uint32_t) start);
+        if (n_block != sequence.n_starts.begin()) {
+            --n_block;
+        }
+        for (; (n_block != sequence.n_starts.end()) && (*n_block < stop); ++n_block) {
+            const std::uint64_t n_start = *n_block;
+            const std::uint64_t n_stop = n_start + sequence.n_sizes[n_block - sequence.n_starts.begin()];
+            for (std::uint64_t p = std::max(start, n_start); p < std::min(stop, n_stop); ++p) {
+                cursor.scratch[p - start] = 'N';
+            }
+        }
+        on_piece(cursor.scratch.data(), cursor.scratch.length());
+    }
+
+    void KmerCountState::increment_mer_count(const std::string& k, const std::string& o, const std::uint64_t& n) { std::uint64_t& v = mer_counts[k]; if (v == 0) { mer_touched.push_back(o); } v += n; }
+    void KmerCountState::increment_mer_count(const char* k, const char* o, const size_t& len, const std::uint64_t& n) {
+        // probe with the window itself: a key string is only built when the k-mer is new
+        emilib::HashMapStringRef key = { k, len };
+        std::uint64_t& v = mer_counts.insert_with_hash(key, mer_counts.hash_of(key)).first->second;
+        if (v == 0) {
+            mer_touched.emplace_back(o, len);
+        }
+        v += n;
+    }
+
+    const std::uint64_t& KmerCounter::dense_max(void) { return _dense_max; }
+    void KmerCounter::dense_max(const std::uint64_t& m) { _dense_max = m; }
+    const std::uint64_t& KmerCounter::expected_kmers(void) { return _expected_kmers; }
+    void KmerCounter::expected_kmers(const std::uint64_t& n) { _expected_kmers = n; }
+    const int& KmerCounter::threads(void) { return _threads; }
+    void KmerCounter::threads(const int& t) { _threads = t; }
+    const int& KmerCounter::min_qual(void) { return _min_qual; }
+    void KmerCounter::min_qual(const int& q) { _min_qual = q; }
+
+    std::int64_t KmerCounter::mer_key(const std::uint64_t& code) { return _offset + (std::int64_t) mer_map_index(code, _k); }
     
     const std::string& KmerCounter::results_dir(void) { return _results_dir; }
     void KmerCounter::results_dir(const std::string& s) { _results_dir = s; }
@@ -275,8 +1897,6 @@ namespace kmer_counter
     
     const int& KmerCounter::offset(void) { return _offset; }
     void KmerCounter::offset(const int& o) { _offset = o; }
-    int KmerCounter::offset(const bool& increment) { int _o = _offset; if (increment) { _offset++; } return _o; }
-    void KmerCounter::increment_offset(void) { ++_offset; }
 
     FILE* KmerCounter::in_stream(void) { return _in_stream; }
     void KmerCounter::in_stream(FILE** isp) { _in_stream = *isp; }
@@ -288,10 +1908,27 @@ namespace kmer_counter
             std::exit(ENODATA); /* No message is available on the STREAM head read queue (POSIX.1) */
         }
         this->in_stream(&in_fp);
+        _input.open(in_fp, this->threads());
     }
     void KmerCounter::close_in_stream(void) {
+        _input.close();
         std::fclose(this->in_stream());
     }
+    InputReader& KmerCounter::input(void) { return _input; }
+
+    const std::string& KmerCounter::reference_fn(void) { return _reference_fn; }
+    void KmerCounter::reference_fn(const std::string& s) {
+        struct stat s_stat;
+        if (stat(s.c_str(), &s_stat) == 0) {
+            _reference_fn = s;
+            _reference.open(s);
+        }
+        else {
+            std::fprintf(stderr, "Error: Reference file does not exist (%s)\n", s.c_str());
+            std::exit(ENODATA); /* No message is available on the STREAM head read queue (POSIX.1) */
+        }
+    }
+    const ReferenceGenome& KmerCounter::reference(void) { return _reference; }
 
     const std::string& KmerCounter::input_fn(void) { return _input_fn; }
     void KmerCounter::input_fn(const std::string& s) {
@@ -308,6 +1945,10 @@ namespace kmer_counter
     KmerCounter::KmerCounter() {
         k(-1);
         offset(-1);
+        dense_max(KMER_COUNTER_DENSE_MAX);
+        threads(1);
+        min_qual(0);
+        expected_kmers(0);
     }
     
     KmerCounter::~KmerCounter() {
@@ -0,0 +1,98 @@
+//
+// Adds random 64-bit k-mer codes to one ConcurrentCountMap from several threads
+// and checks every count against a HashMap filled from a single thread. Every
+// thread also adds the all-T 32-mer, whose code is the table's EmptyKey, and
+// the all-A 32-mer next to it, so both must come back with their full counts.
+//
+// $ ./concurrent-count-map [codes per thread] [threads]
+//
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "../hash_map.hpp"
+
+typedef emilib::ConcurrentCountMap<std::uint64_t, std::uint64_t> SharedTable;
+typedef emilib::HashMap<std::uint64_t, std::uint64_t> SerialTable;
+
+static const std::uint64_t all_t = ~0ULL;
+static const std::uint64_t all_a = 0;
+
+static void fail(const char* what, std::uint64_t value)
+{
+    std::fprintf(stderr, "Error: %s (%" PRIu64 ")\n", what, value);
+    std::exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv)
+{
+    const std::uint64_t per_thread = (argc > 1) ? std::strtoull(argv[1], NULL, 10) : 1000000;
+    const std::uint64_t n_threads = (argc > 2) ? std::strtoull(argv[2], NULL, 10) : 4;
+    std::vector<std::vector<std::uint64_t>> codes(n_threads);
+    std::vector<std::thread> workers;
+    SharedTable shared;
+    SerialTable serial;
+
+    if ((per_thread == 0) || (n_threads == 0)) {
+        std::fprintf(stderr, "Error: Need at least one code on at least one thread\n");
+        std::exit(EXIT_FAILURE);
+    }
+
+    // a small pool of codes, so that threads race to claim and add to the same slots
+    std::mt19937_64 rng(123);
+    std::vector<std::uint64_t> pool(per_thread / 4 + 1);
+    for (auto& c : pool) {
+        c = rng();
+    }
+    for (auto& thread_codes : codes) {
+        for (std::uint64_t i = 0; i < per_thread; ++i) {
+            thread_codes.push_back(pool[rng() % pool.size()]);
+        }
+        thread_codes.push_back(all_t);
+        thread_codes.push_back(all_a);
+        for (auto c : thread_codes) {
+            serial[c]++;
+        }
+    }
+
+    shared.reserve(serial.size());
+    for (std::uint64_t i = 0; i < n_threads; ++i) {
+        workers.emplace_back([&shared, &codes, i]() {
+            for (auto c : codes[i]) {
+                if (!shared.add(c, 1)) {
+                    fail("Shared table refused a k-mer it was sized for", c);
+                }
+            }
+        });
+    }
+    for (auto iter = workers.begin(); iter != workers.end(); ++iter) {
+        iter->join();
+    }
+
+    if (shared.size() != serial.size()) {
+        fail("Shared table holds a different number of k-mers", shared.size());
+    }
+    if ((shared.get(all_t) != n_threads) || (shared.get(all_a) != n_threads)) {
+        fail("Shared table lost adds", (shared.get(all_t) != n_threads) ? all_t : all_a);
+    }
+    // scan in two ranges, as the counter does with two threads
+    const size_t half = shared.bucket_count() / 2;
+    std::uint64_t seen = 0;
+    auto check = [&serial, &seen](const std::uint64_t& code, const std::uint64_t& count) {
+        const std::uint64_t* expected = serial.try_get(code);
+        if (!expected || (*expected != count)) {
+            fail("Shared table count differs from the serial count", code);
+        }
+        ++seen;
+    };
+    shared.for_each(0, half, check);
+    shared.for_each(half, shared.bucket_count(), check);
+    if (seen != serial.size()) {
+        fail("Shared table scan missed k-mers", seen);
+    }
+    return EXIT_SUCCESS;
+}
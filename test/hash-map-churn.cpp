@@ -0,0 +1,169 @@
+//
+// Counts, looks up and then erases the random k-mer codes of each record, the
+// way KmerCounter reuses one table across records, next to a table emptied
+// with clear() after every record, which holds no deleted slots at all. The
+// erased tables must end up no harder to probe than the cleared ones: HashMap
+// must reach the same longest probe record by record, and GroupHashMap must
+// neither grow, pile up tombstones nor probe further on misses. A third
+// GroupHashMap keeps a sliding window of recent records, so it is only ever
+// partly erased, and must keep its tombstones under an eighth of its slots
+// and its misses within a quarter of a table of the same keys that erased
+// nothing.
+//
+// $ ./hash-map-churn [records] [most k-mers per record]
+//
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <random>
+#include <vector>
+
+#include "../hash_map.hpp"
+
+typedef emilib::HashMap<std::uint64_t, std::uint64_t> LinearTable;
+typedef emilib::GroupHashMap<std::uint64_t, std::uint64_t> GroupTable;
+
+// codes are 28 bits wide, so a code with this bit set is never in a table
+static const std::uint64_t missing_bit = 1ULL << 40;
+static const size_t window_records = 256;
+static const std::uint64_t window_check = 1000;
+
+static void fail(const char* what, std::uint64_t record)
+{
+    std::fprintf(stderr, "Error: %s at record %" PRIu64 "\n", what, record);
+    std::exit(EXIT_FAILURE);
+}
+
+template <typename MapT>
+static void count_record(MapT& counts, const std::vector<std::uint64_t>& codes, std::uint64_t record)
+{
+    for (auto c : codes) {
+        counts[c]++;
+    }
+    for (auto c : codes) {
+        if ((counts.try_get(c) == nullptr) || (counts.try_get(c | missing_bit) != nullptr)) {
+            fail("Lost or invented a k-mer between insert and lookup", record);
+        }
+    }
+}
+
+template <typename MapT>
+static void erase_record(MapT& counts, const std::vector<std::uint64_t>& codes, std::uint64_t record)
+{
+    for (auto c : codes) {
+        counts.erase(c);
+    }
+    if (!counts.empty()) {
+        fail("Erasing every k-mer left the table non-empty", record);
+    }
+}
+
+int main(int argc, char** argv)
+{
+    const std::uint64_t records = (argc > 1) ? std::strtoull(argv[1], NULL, 10) : 10000000;
+    const std::uint64_t max_kmers = (argc > 2) ? std::strtoull(argv[2], NULL, 10) : 16;
+    const std::uint64_t block = records / 10;
+    std::mt19937_64 rng(123);
+    LinearTable linear_erased;
+    LinearTable linear_cleared;
+    GroupTable group_erased;
+    GroupTable group_cleared;
+    std::vector<std::uint64_t> codes;
+    std::uint64_t misses = 0;
+    std::uint64_t erased_probes = 0;
+    std::uint64_t cleared_probes = 0;
+    std::uint64_t max_tombstones = 0;
+    GroupTable group_window;
+    std::deque<std::vector<std::uint64_t>> window;
+    std::uint64_t window_probes = 0;
+    std::uint64_t rebuilt_probes = 0;
+
+    if ((block == 0) || (max_kmers == 0)) {
+        std::fprintf(stderr, "Error: Need at least 10 records of at least one k-mer\n");
+        std::exit(EXIT_FAILURE);
+    }
+
+    for (std::uint64_t r = 1; r <= records; ++r) {
+        codes.resize(1 + (rng() % max_kmers));
+        for (auto& c : codes) {
+            c = rng() & ((1ULL << 28) - 1);
+        }
+
+        count_record(linear_erased, codes, r);
+        count_record(linear_cleared, codes, r);
+        if ((linear_erased.bucket_count() != linear_cleared.bucket_count()) || (linear_erased.max_probe_length() != linear_cleared.max_probe_length())) {
+            fail("HashMap probes further after erasing than after clear()", r);
+        }
+        erase_record(linear_erased, codes, r);
+        linear_cleared.clear();
+        if (linear_erased.max_probe_length() != -1) {
+            fail("HashMap kept a probe length once empty", r);
+        }
+
+        count_record(group_erased, codes, r);
+        count_record(group_cleared, codes, r);
+        misses += codes.size();
+        for (auto c : codes) {
+            erased_probes += group_erased.probe_length(c | missing_bit);
+            cleared_probes += group_cleared.probe_length(c | missing_bit);
+        }
+        if (group_erased.bucket_count() != group_cleared.bucket_count()) {
+            fail("GroupHashMap grew from erased slots alone", r);
+        }
+        erase_record(group_erased, codes, r);
+        group_cleared.clear();
+        if (group_erased.deleted_count() * 32 >= group_erased.bucket_count()) {
+            fail("GroupHashMap kept its tombstones once empty", r);
+        }
+        if (group_erased.deleted_count() > max_tombstones) {
+            max_tombstones = group_erased.deleted_count();
+        }
+
+        for (auto c : codes) {
+            group_window[c]++;
+        }
+        if (group_window.deleted_count() * 8 >= group_window.bucket_count()) {
+            fail("GroupHashMap let tombstones take an eighth of a partly erased table", r);
+        }
+        window.push_back(codes);
+        if (window.size() > window_records) {
+            for (auto c : window.front()) {
+                if (--group_window[c] == 0) {
+                    group_window.erase(c);
+                }
+            }
+            window.pop_front();
+        }
+        if (r % window_check == 0) {
+            // the same keys in a table of the same size that never erased anything
+            GroupTable rebuilt;
+            rebuilt.reserve(group_window.bucket_count() * 7 / 8 - 1);
+            for (auto iter = group_window.begin(); iter != group_window.end(); ++iter) {
+                rebuilt[iter->first] = iter->second;
+            }
+            for (auto c : codes) {
+                window_probes += group_window.probe_length(c | missing_bit);
+                rebuilt_probes += rebuilt.probe_length(c | missing_bit);
+            }
+        }
+
+        if (r % block == 0) {
+            std::printf("records %" PRIu64 "\tgroup misses probe %.3f groups after erase, %.3f after clear()\tmost tombstones %" PRIu64 "\twindow tombstones %zu of %zu slots\n",
+                        r, (double) erased_probes / misses, (double) cleared_probes / misses, max_tombstones, group_window.deleted_count(), group_window.bucket_count());
+        }
+    }
+
+    // tombstones left below the sweep threshold may lengthen a few probes, but not by much;
+    // in a partly erased table up to an eighth of the slots may be tombstones, so allow more
+    if (erased_probes * 16 > cleared_probes * 17) {
+        std::fprintf(stderr, "Error: GroupHashMap misses probed %" PRIu64 " groups after erase, against %" PRIu64 " after clear()\n", erased_probes, cleared_probes);
+        std::exit(EXIT_FAILURE);
+    }
+    if (window_probes * 4 > rebuilt_probes * 5) {
+        std::fprintf(stderr, "Error: GroupHashMap misses probed %" PRIu64 " groups in a partly erased table, against %" PRIu64 " in a rebuilt one\n", window_probes, rebuilt_probes);
+        std::exit(EXIT_FAILURE);
+    }
+    return EXIT_SUCCESS;
+}